@@ -0,0 +1,147 @@
+#ifndef KALEIDOSCOPE_COMPILESTATS_H
+#define KALEIDOSCOPE_COMPILESTATS_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <sys/resource.h>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm {
+
+// CompileStats - Where the time goes in a --stats run: the time spent in each
+// phase of compilation, and how big each function is before and after
+// optimization.
+//
+// Optimization and code generation can run on several JIT compile threads at
+// once, so everything is kept behind a lock and the time of a phase is the
+// sum over the threads that ran it. CPU times are those of the whole process.
+class CompileStats {
+    public:
+    enum Phase {
+        Parse, // Includes lexing, which is done token by token while parsing.
+        IRGen, // Includes compiling bytecode for the interpreter.
+        Optimize,
+        CodeGen,
+        Execute, // Includes lazily compiling functions on their first call.
+        NumPhases,
+    };
+
+    // PhaseTimer - Adds the time from its construction to its destruction to
+    // a phase, does nothing if Stats is null.
+    class PhaseTimer {
+        CompileStats *Stats;
+        Phase P;
+        TimeRecord Start;
+
+        public:
+        PhaseTimer(CompileStats *Stats, Phase P) : Stats(Stats), P(P) {
+            if (Stats)
+                Start = TimeRecord::getCurrentTime(/*Start=*/true);
+        }
+        ~PhaseTimer() {
+            if (!Stats)
+                return;
+            TimeRecord T = TimeRecord::getCurrentTime(/*Start=*/false);
+            T -= Start;
+            std::lock_guard<std::mutex> Guard(Stats->Lock);
+            Stats->Times[P] += T;
+        }
+        PhaseTimer(const PhaseTimer &) = delete;
+        PhaseTimer &operator=(const PhaseTimer &) = delete;
+    };
+
+    // Record the number of instructions of the functions defined in M, which
+    // is about to be optimized or has just been.
+    void countInstructions(const Module &M, bool Optimized) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        for (const Function &F : M) {
+            if (F.isDeclaration())
+                continue;
+            FunctionStats &FS = Functions[F.getName().str()];
+            if (Optimized) {
+                FS.After += F.getInstructionCount();
+            } else {
+                ++FS.Compiles;
+                FS.Before += F.getInstructionCount();
+            }
+        }
+    }
+
+    // Write the report as JSON. Rates gives counters of things done while
+    // parsing (tokens, AST nodes...), which are reported along with how many
+    // were handled per second. LLVM's statistics are included as well.
+    void print(raw_ostream &OS,
+               ArrayRef<std::pair<StringRef, uint64_t>> Rates) const {
+        static const char *const PhaseNames[NumPhases] = {
+            "parse", "irgen", "optimize", "codegen", "execute"};
+
+        std::lock_guard<std::mutex> Guard(Lock);
+        json::OStream J(OS, /*IndentSize=*/2);
+        J.object([&] {
+            J.attributeObject("phases", [&] {
+                for (unsigned P = 0; P != NumPhases; ++P)
+                    J.attributeObject(PhaseNames[P], [&] {
+                        J.attribute("wall", Times[P].getWallTime());
+                        J.attribute("user", Times[P].getUserTime());
+                        J.attribute("system", Times[P].getSystemTime());
+                    });
+            });
+
+            double ParseTime = Times[Parse].getWallTime();
+            for (auto &Rate : Rates) {
+                J.attribute(Rate.first, int64_t(Rate.second));
+                J.attribute((Rate.first + "_per_second").str(),
+                            ParseTime > 0 ? Rate.second / ParseTime : 0.0);
+            }
+
+            J.attributeArray("functions", [&] {
+                for (auto &F : Functions)
+                    J.object([&] {
+                        J.attribute("name", F.first);
+                        J.attribute("compiles", int64_t(F.second.Compiles));
+                        J.attribute("instructions_before",
+                                    int64_t(F.second.Before));
+                        J.attribute("instructions_after",
+                                    int64_t(F.second.After));
+                    });
+            });
+
+            J.attributeObject("statistics", [&] {
+                for (auto &Stat : GetStatistics())
+                    J.attribute(Stat.first, int64_t(Stat.second));
+            });
+
+            // ru_maxrss is in kilobytes on Linux.
+            struct rusage Usage;
+            if (getrusage(RUSAGE_SELF, &Usage) == 0)
+                J.attribute("peak_rss_bytes", int64_t(Usage.ru_maxrss) * 1024);
+        });
+        OS << '\n';
+    }
+
+    private:
+    struct FunctionStats {
+        // A function is compiled more than once if its name is reused, as
+        // __anon_expr is.
+        uint64_t Compiles = 0;
+        uint64_t Before = 0, After = 0; // Summed over compiles.
+    };
+
+    mutable std::mutex Lock;
+    TimeRecord Times[NumPhases];
+    std::map<std::string, FunctionStats> Functions; // Sorted for the report.
+};
+
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_COMPILESTATS_H
@@ -0,0 +1,250 @@
+#ifndef KALEIDOSCOPE_INTERPRETER_H
+#define KALEIDOSCOPE_INTERPRETER_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorHandling.h"
+
+// Bytecode - A function compiled for the Interpreter: a flat array of
+// instructions over a frame of double registers. Registers are numbered
+//
+//   [0, NumArgs)               arguments, the first variable slots
+//   [NumArgs, ConstBase)       the other variables and temporaries
+//   [ConstBase, NumRegs)       Consts, copied in when the frame is set up
+//
+// so that constant operands need no instruction of their own.
+struct Bytecode {
+    enum Opcode : uint8_t {
+        Move,       // R[A] = R[B]
+        Add,        // R[A] = R[B] + R[C]
+        Sub,        // R[A] = R[B] - R[C]
+        Mul,        // R[A] = R[B] * R[C]
+        Less,       // R[A] = R[B] < R[C] or unordered ? 1.0 : 0.0
+        Jump,       // go to B
+        JumpIfFalse, // go to B unless R[A] is ordered and not 0.0
+        LoopIfTrue, // go to B, a loop back edge, if R[A] is ordered and not 0.0
+        Call,       // R[A] = function C (R[A], ..., R[A + B - 1])
+        Count,      // add one to *Counters[A]
+        Ret,        // return R[A]
+    };
+    static constexpr unsigned NumOpcodes = Ret + 1;
+
+    struct Instr {
+        Opcode Op;
+        uint32_t A, B, C;
+    };
+
+    std::vector<Instr> Code;
+    std::vector<double> Consts;
+    // When profiling, the function's profile counters, which its native code
+    // adds to as well.
+    std::vector<uint64_t *> Counters;
+    unsigned NumArgs = 0;
+    unsigned ConstBase = 0;
+    unsigned NumRegs = 0;
+};
+
+// Interpreter - The first tier of tiered execution. Code starts out as
+// Bytecode, which costs next to nothing to produce, and only functions that
+// turn out to be hot are compiled to native code by the JIT.
+//
+// Functions are identified by the symbol of their name. Each one counts how
+// often it was called and how many loop back edges it took: once that passes
+// the threshold, the next call promotes it, asking the resolver for its
+// native code and calling that from then on. Functions without bytecode, like
+// externs, are resolved and called natively on their first call.
+class Interpreter {
+    public:
+    using Resolver =
+        llvm::unique_function<llvm::Expected<llvm::JITTargetAddress>(uint32_t)>;
+
+    // Native calls are made through a function pointer of the right type,
+    // functions taking more arguments than this can't be called.
+    static constexpr unsigned MaxNativeArgs = 8;
+
+    Interpreter(unsigned TierUpThreshold, Resolver Resolve)
+        : TierUpThreshold(TierUpThreshold), Resolve(std::move(Resolve)) {}
+
+    // Interpret calls of Sym with Code until it gets hot.
+    void define(uint32_t Sym, std::unique_ptr<Bytecode> Code) {
+        Callee &C = getCallee(Sym);
+        C.Code = std::move(Code);
+        C.Native = 0;
+        C.Hotness = 0;
+    }
+
+    // Whether Sym has been promoted to (or is) native code.
+    bool isNative(uint32_t Sym) const {
+        return Sym < Callees.size() && Callees[Sym].Native;
+    }
+
+    // Run a function of no arguments, for a top-level expression.
+    llvm::Expected<double> run(const Bytecode &F) {
+        uint32_t Hotness = 0; // Only ever called the once.
+        Stack.resize(F.NumRegs);
+        auto Result = exec(F, Hotness, 0);
+        Stack.clear();
+        return Result;
+    }
+
+    private:
+    struct Callee {
+        std::unique_ptr<Bytecode> Code;
+        llvm::JITTargetAddress Native = 0;
+        uint32_t Hotness = 0;
+    };
+
+    unsigned TierUpThreshold;
+    Resolver Resolve;
+    // By symbol. A deque so that growing it for a callee reached from a
+    // frame being interpreted doesn't move the Hotness that frame counts.
+    std::deque<Callee> Callees;
+    // The frames of the functions being interpreted, each one's registers
+    // follow its caller's.
+    std::vector<double> Stack;
+
+    Callee &getCallee(uint32_t Sym) {
+        if (Sym >= Callees.size())
+            Callees.resize(Sym + 1);
+        return Callees[Sym];
+    }
+
+    static double callNative(llvm::JITTargetAddress Addr, const double *A,
+            unsigned N) {
+        using D = double;
+        switch (N) {
+        case 0: return ((D (*)())Addr)();
+        case 1: return ((D (*)(D))Addr)(A[0]);
+        case 2: return ((D (*)(D, D))Addr)(A[0], A[1]);
+        case 3: return ((D (*)(D, D, D))Addr)(A[0], A[1], A[2]);
+        case 4: return ((D (*)(D, D, D, D))Addr)(A[0], A[1], A[2], A[3]);
+        case 5:
+            return ((D (*)(D, D, D, D, D))Addr)(A[0], A[1], A[2], A[3], A[4]);
+        case 6:
+            return ((D (*)(D, D, D, D, D, D))Addr)(A[0], A[1], A[2], A[3],
+                    A[4], A[5]);
+        case 7:
+            return ((D (*)(D, D, D, D, D, D, D))Addr)(A[0], A[1], A[2], A[3],
+                    A[4], A[5], A[6]);
+        case 8:
+            return ((D (*)(D, D, D, D, D, D, D, D))Addr)(A[0], A[1], A[2],
+                    A[3], A[4], A[5], A[6], A[7]);
+        }
+        llvm_unreachable("too many arguments for a native call");
+    }
+
+    // Call Sym with the NumArgs arguments at Stack[ArgsAt].
+    llvm::Expected<double> call(uint32_t Sym, size_t ArgsAt,
+            unsigned NumArgs) {
+        Callee &C = getCallee(Sym);
+        if (!C.Native && (!C.Code || C.Hotness >= TierUpThreshold)) {
+            auto Addr = Resolve(Sym);
+            if (!Addr)
+                return Addr.takeError();
+            C.Native = *Addr;
+        }
+        if (C.Native)
+            return callNative(C.Native, &Stack[ArgsAt], NumArgs);
+
+        ++C.Hotness;
+        // The callee's frame starts with its arguments, which are where the
+        // caller left them: past the end of the caller's frame.
+        const Bytecode &F = *C.Code;
+        size_t Base = Stack.size();
+        Stack.resize(Base + F.NumRegs);
+        std::copy_n(&Stack[ArgsAt], NumArgs, &Stack[Base]);
+        auto Result = exec(F, C.Hotness, Base);
+        Stack.resize(Base);
+        return Result;
+    }
+
+    // Interpret F in the frame at Stack[Base], whose arguments are set.
+    llvm::Expected<double> exec(const Bytecode &F, uint32_t &Hotness,
+            size_t Base) {
+        double *R = &Stack[Base];
+        std::copy(F.Consts.begin(), F.Consts.end(), R + F.ConstBase);
+        const Bytecode::Instr *Code = F.Code.data();
+        const Bytecode::Instr *IP = Code;
+
+        // Threaded dispatch where the compiler has computed goto, each
+        // instruction jumps straight to the next one's handler.
+#if defined(__GNUC__)
+        static const void *const Dispatch[Bytecode::NumOpcodes] = {
+            &&Op_Move, &&Op_Add, &&Op_Sub, &&Op_Mul, &&Op_Less, &&Op_Jump,
+            &&Op_JumpIfFalse, &&Op_LoopIfTrue, &&Op_Call, &&Op_Count,
+            &&Op_Ret};
+#define VM_OP(Name) Op_##Name:
+#define VM_NEXT() goto *Dispatch[IP->Op]
+        VM_NEXT();
+#else
+#define VM_OP(Name) case Bytecode::Name:
+#define VM_NEXT() continue
+        for (;;) switch (IP->Op) {
+#endif
+        VM_OP(Move)
+            R[IP->A] = R[IP->B];
+            ++IP;
+            VM_NEXT();
+        VM_OP(Add)
+            R[IP->A] = R[IP->B] + R[IP->C];
+            ++IP;
+            VM_NEXT();
+        VM_OP(Sub)
+            R[IP->A] = R[IP->B] - R[IP->C];
+            ++IP;
+            VM_NEXT();
+        VM_OP(Mul)
+            R[IP->A] = R[IP->B] * R[IP->C];
+            ++IP;
+            VM_NEXT();
+        VM_OP(Less)
+            R[IP->A] = !(R[IP->B] >= R[IP->C]) ? 1.0 : 0.0;
+            ++IP;
+            VM_NEXT();
+        VM_OP(Jump)
+            IP = Code + IP->B;
+            VM_NEXT();
+        VM_OP(JumpIfFalse)
+            // Not (ordered and not equal to 0.0), like fcmp one.
+            IP = R[IP->A] == 0.0 || R[IP->A] != R[IP->A] ? Code + IP->B
+                                                         : IP + 1;
+            VM_NEXT();
+        VM_OP(LoopIfTrue)
+            if (R[IP->A] == 0.0 || R[IP->A] != R[IP->A]) {
+                ++IP;
+            } else {
+                ++Hotness;
+                IP = Code + IP->B;
+            }
+            VM_NEXT();
+        VM_OP(Call) {
+            auto Result = call(IP->C, Base + IP->A, IP->B);
+            if (!Result)
+                return Result.takeError();
+            // The call may have grown the stack.
+            R = &Stack[Base];
+            R[IP->A] = *Result;
+            ++IP;
+            VM_NEXT();
+        }
+        VM_OP(Count)
+            ++*F.Counters[IP->A];
+            ++IP;
+            VM_NEXT();
+        VM_OP(Ret)
+            return R[IP->A];
+#if !defined(__GNUC__)
+        }
+#endif
+#undef VM_OP
+#undef VM_NEXT
+    }
+};
+
+#endif // KALEIDOSCOPE_INTERPRETER_H
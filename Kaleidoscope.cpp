@@ -0,0 +1,3147 @@
+// C++ STL imports
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <utility>
+#include <map>
+#include <optional>
+#include <mutex>
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+
+// C imports
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+// LLVM imports
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CompileStats.h"
+#include "Interpreter.h"
+#include "Kaleidoscope.h"
+#include "KaleidoscopeJIT.h"
+#include "Profile.h"
+#include "SourceBuffer.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+#define DEBUG_TYPE "kaleidoscope"
+
+ALWAYS_ENABLED_STATISTIC(NumTokens, "Number of tokens lexed");
+ALWAYS_ENABLED_STATISTIC(NumASTNodes, "Number of expression nodes parsed");
+ALWAYS_ENABLED_STATISTIC(MaxASTBytes,
+                         "Most memory held by expression nodes at once");
+ALWAYS_ENABLED_STATISTIC(NumDefinitions, "Number of functions defined");
+ALWAYS_ENABLED_STATISTIC(NumExterns, "Number of externs declared");
+ALWAYS_ENABLED_STATISTIC(NumTopLevelExprs,
+                         "Number of top-level expressions evaluated");
+ALWAYS_ENABLED_STATISTIC(NumBatchKernels, "Number of batch kernels built");
+ALWAYS_ENABLED_STATISTIC(NumMathIntrinsics,
+                         "Number of math library calls lowered to intrinsics");
+ALWAYS_ENABLED_STATISTIC(NumFoldedExprs,
+                         "Number of constant top-level expressions folded");
+ALWAYS_ENABLED_STATISTIC(NumCachedExprs,
+                         "Number of top-level calls served from the cache");
+ALWAYS_ENABLED_STATISTIC(NumResultCacheFlushes,
+                         "Number of times the result cache filled up");
+ALWAYS_ENABLED_STATISTIC(MaxJITCodeBytes,
+                         "Most memory mapped for JITed code and data at once");
+ALWAYS_ENABLED_STATISTIC(NumInterpretedExprs,
+                         "Number of top-level expressions interpreted");
+ALWAYS_ENABLED_STATISTIC(NumTierUps,
+                         "Number of definitions handed to the JIT");
+
+/**
+ * Kaleidoscope is an untyped language with syntax similar to Python
+ * and uses the 64-bit floating point type for all values (pattern
+ * similar to NaN boxing in Lisps).
+ *
+ * Example of a function in Kaleidoscope:
+ *
+ * def fib(x)
+ *  if x < 3 then
+ *    1
+ *  else
+ *    fib(x - 1) + fib(x - 2)
+ */
+
+// Keywords are interned first so the lexer can recognise them by comparing
+// symbols, KeywordNames and KeywordTokens are indexed by these.
+enum KeywordSymbol : Symbol {
+  sym_def,
+  sym_extern,
+  sym_if,
+  sym_then,
+  sym_else,
+  sym_for,
+  sym_in,
+  sym_var,
+  sym_vectorize,
+  sym_memo,
+  NumKeywords,
+};
+static const char *const KeywordNames[NumKeywords] = {
+    "def", "extern", "if", "then", "else", "for", "in", "var", "vectorize",
+    "memo"};
+static const int KeywordTokens[NumKeywords] = {
+    tok_def, tok_extern, tok_if, tok_then, tok_else, tok_for, tok_in,
+    tok_var, tok_vectorize, tok_memo};
+
+// SymbolTable - Interns identifiers, every distinct name is hashed once at
+// lex time and handed a Symbol, from then on names are compared and looked up
+// by their symbol only.
+class SymbolTable {
+    StringMap<Symbol, BumpPtrAllocator> Ids;
+    std::vector<StringRef> Names; // Indexed by symbol, point into Ids.
+    std::mutex Lock; // Taken by internShared().
+
+    public:
+    SymbolTable() {
+        for (const char *Keyword : KeywordNames)
+            intern(Keyword);
+    }
+
+    Symbol intern(StringRef Name) {
+        auto Entry = Ids.try_emplace(Name, Symbol(Names.size()));
+        if (Entry.second)
+            Names.push_back(Entry.first->getKey());
+        return Entry.first->second;
+    }
+
+    // intern() for lexers running on several threads at once, nothing else
+    // may use the table meanwhile.
+    Symbol internShared(StringRef Name) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        return intern(Name);
+    }
+
+    StringRef getName(Symbol S) const { return Names[S]; }
+    size_t size() const { return Names.size(); }
+    size_t getMemorySize() const {
+        return Ids.getAllocator().getTotalMemory() +
+               Ids.getNumBuckets() * sizeof(void *) +
+               Names.capacity() * sizeof(StringRef);
+    }
+};
+
+// Grow a table indexed by symbol so that S is a valid index.
+template <typename T> static T &symbolEntry(std::vector<T> &Table, Symbol S) {
+    if (S >= Table.size())
+        Table.resize(S + 1);
+    return Table[S];
+}
+
+// Lexer - Splits a source buffer into tokens, interning identifiers as it
+// goes.
+class Lexer {
+    SymbolTable &Symbols;
+    std::unique_ptr<SourceBuffer> TheSource; // Input being lexed.
+    bool Interactive = false; // Print prompts, set when reading stdin.
+    unsigned CurLine = 1; // Line the lexer is on.
+    size_t CurLineStart = 0; // Input offset the current line starts at.
+    // If Symbols is shared with lexers on other threads, the symbols this one
+    // has seen, so the shared table is only locked for new names.
+    std::optional<StringMap<Symbol>> SharedIds;
+
+    Symbol intern(StringRef Name) {
+        if (!SharedIds)
+            return Symbols.intern(Name);
+        auto Entry = SharedIds->try_emplace(Name, 0);
+        if (Entry.second)
+            Entry.first->second = Symbols.internShared(Name);
+        return Entry.first->second;
+    }
+
+    public:
+    explicit Lexer(SymbolTable &Symbols, bool Shared = false)
+        : Symbols(Symbols) {
+        if (Shared)
+            SharedIds.emplace();
+    }
+
+    // Lex from Source from now on, starting over at line 1.
+    void setSource(std::unique_ptr<SourceBuffer> Source, bool IsInteractive) {
+        TheSource = std::move(Source);
+        Interactive = IsInteractive;
+        CurLine = 1;
+        CurLineStart = 0;
+    }
+    bool isInteractive() const { return Interactive; }
+
+    // Return the next token from the source buffer.
+    Token getTok();
+};
+
+Token Lexer::getTok() {
+  Token Tok;
+  while (true) {
+    const char *P = TheSource->getCur();
+
+    // Skip whitespace
+    while (isspace((unsigned char)*P)) {
+        if (*P == '\n') {
+            ++CurLine;
+            CurLineStart = TheSource->getOffset(P + 1);
+        }
+        ++P;
+    }
+    TheSource->setCur(P);
+    Tok.Loc = {CurLine, unsigned(TheSource->getOffset(P) - CurLineStart + 1)};
+
+    if (isalpha((unsigned char)*P)) {
+      const char *Start = P;
+      while (isalnum((unsigned char)*++P))
+          ;
+      // The identifier may continue past the end of the buffer, get more
+      // input and scan it again.
+      if (P == TheSource->getEnd() && TheSource->refill())
+          continue;
+      TheSource->setCur(P);
+      Tok.Text = std::string_view(Start, P - Start);
+      Tok.Sym = intern(StringRef(Start, P - Start));
+      Tok.Kind = Tok.Sym < NumKeywords ? KeywordTokens[Tok.Sym]
+                                       : tok_identifier;
+      return Tok;
+    }
+    if (isdigit((unsigned char)*P) || *P == '.') {
+      const char *Start = P;
+      while (isdigit((unsigned char)*++P) || *P == '.')
+          ;
+      if (P == TheSource->getEnd() && TheSource->refill())
+          continue;
+      TheSource->setCur(P);
+
+      // Like strtod, use the longest prefix that is a valid number.
+      Tok.Kind = tok_number;
+      Tok.Text = std::string_view(Start, P - Start);
+      Tok.NumVal = 0.0;
+      std::from_chars(Start, P, Tok.NumVal);
+      return Tok;
+    }
+    if (*P == '#') {
+      // Comment until end of line, the comment is consumed as we go so a
+      // refill doesn't have to keep it.
+      while (true) {
+          while (*P != '\n' && *P != '\r' && P != TheSource->getEnd())
+              ++P;
+          TheSource->setCur(P);
+          if (P != TheSource->getEnd() || !TheSource->refill())
+              break;
+          P = TheSource->getCur();
+      }
+      continue;
+    }
+    if (P == TheSource->getEnd()) {
+      if (TheSource->refill())
+          continue;
+      Tok.Kind = tok_eof;
+      return Tok;
+    }
+    TheSource->setCur(P + 1);
+    Tok.Kind = (unsigned char)*P;
+    Tok.Text = std::string_view(P, 1);
+    return Tok;
+  }
+}
+
+// ExprPool - The expression nodes of the items being parsed, stored flat as
+// a struct of arrays: node E has kind Kinds[E] and two 32-bit operands
+// Data[E], whose meaning depends on the kind. Children are referred to by
+// their ExprId, like any other operand, and what doesn't fit in two operands
+// goes in Extra. Generated programs have millions of nodes, which take a
+// fraction of the memory of a tree of objects and are walked front to back.
+//
+//   EK_Number     Numbers[L]
+//   EK_Variable   L = slot, R = name
+//   EK_Binary     Ops[E], L = LHS, R = RHS
+//   EK_Call       L = callee, Extra[R] = number of args, then the args
+//   EK_If         L = cond, Extra[R] = then, else
+//   EK_For        L = slot, Extra[R] = var name, start, end, step, body
+//   EK_Var        L = body, Extra[R] = number of vars, first in Bindings
+//
+// For assignment ('=') the parser makes sure the LHS is a variable. Nodes are
+// only ever added, clear() drops them all at once but keeps the memory for
+// the next item.
+class ExprPool {
+    public:
+    enum ExprKind : uint8_t {
+        EK_Number,
+        EK_Variable,
+        EK_Binary,
+        EK_Call,
+        EK_If,
+        EK_For,
+        EK_Var,
+    };
+
+    // One variable of var/in, each gets a new slot.
+    struct Binding {
+        Symbol Name;
+        unsigned Slot; // Index of the variable in NamedValues.
+        ExprId Init; // NoExpr if the variable starts out as 0.0.
+    };
+
+    private:
+    struct Operands {
+        uint32_t L, R;
+    };
+
+    std::vector<ExprKind> Kinds;
+    std::vector<char> Ops; // Binary operator, 0 for the other kinds.
+    std::vector<Operands> Data;
+    std::vector<double> Numbers;
+    std::vector<uint32_t> Extra;
+    std::vector<Binding> Bindings;
+
+    ExprId add(ExprKind Kind, uint32_t L, uint32_t R, char Op = 0) {
+        Kinds.push_back(Kind);
+        Ops.push_back(Op);
+        Data.push_back({L, R});
+        return Kinds.size() - 1;
+    }
+    uint32_t addExtra(std::initializer_list<uint32_t> Vals) {
+        Extra.insert(Extra.end(), Vals);
+        return Extra.size() - Vals.size();
+    }
+
+    public:
+    ExprKind getKind(ExprId E) const { return Kinds[E]; }
+    bool isSimple(ExprId E) const {
+        return Kinds[E] == EK_Number || Kinds[E] == EK_Variable;
+    }
+
+    // EK_Number.
+    double getVal(ExprId E) const { return Numbers[Data[E].L]; }
+    // EK_Variable and EK_For.
+    unsigned getSlot(ExprId E) const { return Data[E].L; }
+    Symbol getName(ExprId E) const {
+        return Kinds[E] == EK_For ? Extra[Data[E].R] : Data[E].R;
+    }
+    // EK_Binary.
+    char getOp(ExprId E) const { return Ops[E]; }
+    ExprId getLHS(ExprId E) const { return Data[E].L; }
+    ExprId getRHS(ExprId E) const { return Data[E].R; }
+    // EK_Call.
+    Symbol getCallee(ExprId E) const { return Data[E].L; }
+    ArrayRef<ExprId> getArgs(ExprId E) const {
+        return ArrayRef<ExprId>(&Extra[Data[E].R] + 1, Extra[Data[E].R]);
+    }
+    // EK_If.
+    ExprId getCond(ExprId E) const { return Data[E].L; }
+    ExprId getThen(ExprId E) const { return Extra[Data[E].R]; }
+    ExprId getElse(ExprId E) const { return Extra[Data[E].R + 1]; }
+    // EK_For, the step is NoExpr if omitted.
+    ExprId getStart(ExprId E) const { return Extra[Data[E].R + 1]; }
+    ExprId getEnd(ExprId E) const { return Extra[Data[E].R + 2]; }
+    ExprId getStep(ExprId E) const { return Extra[Data[E].R + 3]; }
+    // EK_For and EK_Var.
+    ExprId getBody(ExprId E) const {
+        return Kinds[E] == EK_For ? Extra[Data[E].R + 4] : Data[E].L;
+    }
+    // EK_Var.
+    ArrayRef<Binding> getVars(ExprId E) const {
+        const uint32_t *V = &Extra[Data[E].R];
+        return ArrayRef<Binding>(&Bindings[V[1]], V[0]);
+    }
+
+    ExprId addNumber(double Val) {
+        Numbers.push_back(Val);
+        return add(EK_Number, Numbers.size() - 1, 0);
+    }
+    ExprId addVariable(Symbol Name, unsigned Slot) {
+        return add(EK_Variable, Slot, Name);
+    }
+    ExprId addBinary(char Op, ExprId LHS, ExprId RHS) {
+        return add(EK_Binary, LHS, RHS, Op);
+    }
+    ExprId addCall(Symbol Callee, ArrayRef<ExprId> Args) {
+        uint32_t R = addExtra({uint32_t(Args.size())});
+        Extra.insert(Extra.end(), Args.begin(), Args.end());
+        return add(EK_Call, Callee, R);
+    }
+    ExprId addIf(ExprId Cond, ExprId Then, ExprId Else) {
+        return add(EK_If, Cond, addExtra({Then, Else}));
+    }
+    ExprId addFor(Symbol VarName, unsigned Slot, ExprId Start, ExprId End,
+            ExprId Step, ExprId Body) {
+        return add(EK_For, Slot, addExtra({VarName, Start, End, Step, Body}));
+    }
+    ExprId addVar(ArrayRef<Binding> Vars, ExprId Body) {
+        uint32_t R = addExtra({uint32_t(Vars.size()),
+                               uint32_t(Bindings.size())});
+        Bindings.insert(Bindings.end(), Vars.begin(), Vars.end());
+        return add(EK_Var, Body, R);
+    }
+
+    size_t size() const { return Kinds.size(); }
+    // Bytes taken by the nodes, not counting spare capacity.
+    size_t getMemorySize() const {
+        return Kinds.size() * (sizeof(ExprKind) + sizeof(char) +
+                               sizeof(Operands)) +
+               Numbers.size() * sizeof(double) +
+               Extra.size() * sizeof(uint32_t) +
+               Bindings.size() * sizeof(Binding);
+    }
+    void clear() {
+        Kinds.clear();
+        Ops.clear();
+        Data.clear();
+        Numbers.clear();
+        Extra.clear();
+        Bindings.clear();
+    }
+};
+
+// Parser - Builds the AST of one top-level item at a time from the tokens of
+// a Lexer.
+class Parser {
+    Lexer &Lex;
+    Token CurTok;
+    // Expression nodes of the top-level items being handled, released all at
+    // once by ResetAST() after codegen.
+    ExprPool Nodes;
+    // Precedence of each binary operator, higher binds tighter.
+    std::map<char, int> BinopPrecedence;
+    // Variables visible in the function being parsed, innermost last. Each
+    // one is given its own slot, which codegen uses to index NamedValues.
+    SmallVector<std::pair<Symbol, unsigned>, 8> ScopeVars;
+    unsigned NumScopeSlots = 0;
+    // Name of the functions top-level expressions are wrapped in.
+    Symbol AnonExprSym;
+    // Tokens and nodes not yet added to NumTokens and NumASTNodes, which
+    // parsers on other threads may be counting into too.
+    uint64_t TokenCount = 0;
+    size_t NodesCounted = 0;
+
+    public:
+    unsigned NumErrors = 0; // Errors logged so far.
+    // If set, errors are appended here instead of being printed, prefixed
+    // with FileName if that is set.
+    std::string *ErrorLog = nullptr;
+    std::string FileName;
+
+    Parser(Lexer &Lex, SymbolTable &Symbols);
+
+    int getNextToken();
+    const Token &getCurTok() const { return CurTok; }
+
+    ExprId LogErrorAt(SourceLocation Loc, const char *Str);
+    ExprId LogError(const char *Str);
+    std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
+
+    std::unique_ptr<FunctionAST> ParseDefinition();
+    std::unique_ptr<PrototypeAST> ParseExtern();
+    std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+    size_t getASTMemorySize() const { return Nodes.getMemorySize(); }
+    void ResetAST() {
+        flushCounts();
+        Nodes.clear();
+        NodesCounted = 0;
+    }
+    // Add the tokens and nodes read so far to NumTokens and NumASTNodes.
+    void flushCounts() {
+        NumTokens += TokenCount;
+        NumASTNodes += Nodes.size() - NodesCounted;
+        MaxASTBytes.updateMax(Nodes.getMemorySize());
+        TokenCount = 0;
+        NodesCounted = Nodes.size();
+    }
+
+    private:
+
+    void BeginFunctionScope(ArrayRef<Symbol> Args);
+    int LookupScopeVar(Symbol Name);
+    int GetTokPrecedence();
+
+    ExprId ParseNumberExpr();
+    ExprId ParseParenExpr();
+    ExprId ParseIdentifierExpr();
+    ExprId ParseIfExpr();
+    ExprId ParseForExpr();
+    ExprId ParseVarExpr();
+    ExprId ParsePrimary();
+    ExprId ParseBinOpRHS(int ExprPrec, ExprId LHS);
+    ExprId ParseExpression();
+    std::unique_ptr<PrototypeAST> ParsePrototype();
+};
+
+Parser::Parser(Lexer &Lex, SymbolTable &Symbols)
+    : Lex(Lex), AnonExprSym(Symbols.intern("__anon_expr")) {
+    // Fill the binary precedence map
+    BinopPrecedence['='] = 2;
+    BinopPrecedence['<'] = 10;
+    BinopPrecedence['+'] = 20;
+    BinopPrecedence['-'] = 20;
+    BinopPrecedence['*'] = 40;
+}
+
+int Parser::getNextToken() {
+    CurTok = Lex.getTok();
+    ++TokenCount;
+    return CurTok.Kind;
+}
+
+// Log a parsing error at Loc.
+ExprId Parser::LogErrorAt(SourceLocation Loc, const char* Str) {
+    ++NumErrors;
+    if (!ErrorLog) {
+        fprintf(stderr, "Error (line %u, col %u): %s\n", Loc.Line, Loc.Col,
+                Str);
+        return NoExpr;
+    }
+    raw_string_ostream OS(*ErrorLog);
+    if (!FileName.empty())
+        OS << FileName << ": ";
+    OS << "Error (line " << Loc.Line << ", col " << Loc.Col << "): " << Str
+       << '\n';
+    return NoExpr;
+}
+
+// Log a parsing error at the current token.
+ExprId Parser::LogError(const char* Str) {
+    return LogErrorAt(CurTok.Loc, Str);
+}
+
+std::unique_ptr<PrototypeAST> Parser::LogErrorP(const char* Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+// Start parsing a new function whose arguments are Args.
+void Parser::BeginFunctionScope(ArrayRef<Symbol> Args) {
+    ScopeVars.clear();
+    for (Symbol Arg : Args)
+        ScopeVars.push_back({Arg, unsigned(ScopeVars.size())});
+    NumScopeSlots = Args.size();
+}
+
+// Find the slot of the innermost visible variable called Name, or -1.
+int Parser::LookupScopeVar(Symbol Name) {
+    for (auto &Var : llvm::reverse(ScopeVars))
+        if (Var.first == Name)
+            return Var.second;
+    return -1;
+}
+
+// Parse a number literal.
+ExprId Parser::ParseNumberExpr() {
+    ExprId Result = Nodes.addNumber(CurTok.NumVal);
+    getNextToken();
+    return Result;
+}
+
+// Parse a parenthesized expression.
+ExprId Parser::ParseParenExpr() {
+    getNextToken();
+    ExprId V = ParseExpression();
+    if (V == NoExpr)
+        return NoExpr;
+    if (CurTok.Kind != ')')
+        return LogError("expected ')'");
+    getNextToken();
+    return V;
+}
+
+// Parse identifier expressions.
+ExprId Parser::ParseIdentifierExpr() {
+    Symbol IdName = CurTok.Sym;
+    SourceLocation IdLoc = CurTok.Loc;
+    getNextToken();
+
+    if (CurTok.Kind != '(') { // Not a function call, defo a variable.
+        int Slot = LookupScopeVar(IdName);
+        if (Slot < 0)
+            return LogErrorAt(IdLoc, "Unknown variable name");
+        return Nodes.addVariable(IdName, Slot);
+    }
+
+    // It's a function call
+    getNextToken();
+    SmallVector<ExprId, 8> Args;
+    if (CurTok.Kind != ')') {
+        while (true) {
+            ExprId Arg = ParseExpression();
+            if (Arg == NoExpr)
+                return NoExpr;
+            Args.push_back(Arg);
+            if (CurTok.Kind == ')')
+                break;
+            if (CurTok.Kind != ',')
+                return LogError("Expected ')' or ',' in argument list");
+            getNextToken();
+        }
+    }
+
+    getNextToken();
+
+    return Nodes.addCall(IdName, Args);
+}
+
+// Parse "if cond then expr else expr".
+ExprId Parser::ParseIfExpr() {
+    getNextToken(); // eat the if.
+
+    ExprId Cond = ParseExpression();
+    if (Cond == NoExpr)
+        return NoExpr;
+
+    if (CurTok.Kind != tok_then)
+        return LogError("expected then");
+    getNextToken(); // eat the then.
+
+    ExprId Then = ParseExpression();
+    if (Then == NoExpr)
+        return NoExpr;
+
+    if (CurTok.Kind != tok_else)
+        return LogError("expected else");
+    getNextToken(); // eat the else.
+
+    ExprId Else = ParseExpression();
+    if (Else == NoExpr)
+        return NoExpr;
+
+    return Nodes.addIf(Cond, Then, Else);
+}
+
+// Parse "for identifier = expr, expr (, expr)? in expr".
+ExprId Parser::ParseForExpr() {
+    getNextToken(); // eat the for.
+
+    if (CurTok.Kind != tok_identifier)
+        return LogError("expected identifier after for");
+    Symbol IdName = CurTok.Sym;
+    getNextToken(); // eat identifier.
+
+    if (CurTok.Kind != '=')
+        return LogError("expected '=' after for");
+    getNextToken(); // eat '='.
+
+    // The start value is evaluated before the loop variable is in scope.
+    ExprId Start = ParseExpression();
+    if (Start == NoExpr)
+        return NoExpr;
+    if (CurTok.Kind != ',')
+        return LogError("expected ',' after for start value");
+    getNextToken();
+
+    // The rest of the loop sees the loop variable, in a new slot.
+    unsigned Slot = NumScopeSlots++;
+    ScopeVars.push_back({IdName, Slot});
+    auto PopScope = make_scope_exit([this] { ScopeVars.pop_back(); });
+
+    ExprId End = ParseExpression();
+    if (End == NoExpr)
+        return NoExpr;
+
+    // The step value is optional.
+    ExprId Step = NoExpr;
+    if (CurTok.Kind == ',') {
+        getNextToken();
+        Step = ParseExpression();
+        if (Step == NoExpr)
+            return NoExpr;
+    }
+
+    if (CurTok.Kind != tok_in)
+        return LogError("expected 'in' after for");
+    getNextToken(); // eat 'in'.
+
+    ExprId Body = ParseExpression();
+    if (Body == NoExpr)
+        return NoExpr;
+
+    return Nodes.addFor(IdName, Slot, Start, End, Step, Body);
+}
+
+// Parse "var identifier (= expr)? (, identifier (= expr)?)* in expr".
+ExprId Parser::ParseVarExpr() {
+    getNextToken(); // eat the var.
+
+    // At least one variable name is required.
+    if (CurTok.Kind != tok_identifier)
+        return LogError("expected identifier after var");
+
+    // Every variable stays in scope until the end of the body.
+    size_t OuterScope = ScopeVars.size();
+    auto PopScope = make_scope_exit([this, OuterScope] {
+        ScopeVars.truncate(OuterScope);
+    });
+
+    SmallVector<ExprPool::Binding, 4> Vars;
+    while (true) {
+        Symbol Name = CurTok.Sym;
+        getNextToken(); // eat identifier.
+
+        // Read the optional initializer, which sees the variables before
+        // this one but not this one.
+        ExprId Init = NoExpr;
+        if (CurTok.Kind == '=') {
+            getNextToken(); // eat the '='.
+
+            Init = ParseExpression();
+            if (Init == NoExpr)
+                return NoExpr;
+        }
+
+        unsigned Slot = NumScopeSlots++;
+        ScopeVars.push_back({Name, Slot});
+        Vars.push_back({Name, Slot, Init});
+
+        // End of var list, exit loop.
+        if (CurTok.Kind != ',')
+            break;
+        getNextToken(); // eat the ','.
+
+        if (CurTok.Kind != tok_identifier)
+            return LogError("expected identifier list after var");
+    }
+
+    // At this point, we have to have 'in'.
+    if (CurTok.Kind != tok_in)
+        return LogError("expected 'in' keyword after 'var'");
+    getNextToken(); // eat 'in'.
+
+    ExprId Body = ParseExpression();
+    if (Body == NoExpr)
+        return NoExpr;
+
+    return Nodes.addVar(Vars, Body);
+}
+
+// Parse primary expressions (identifiers, number literals, parenthesized
+// expressions, control flow and variable definitions).
+ExprId Parser::ParsePrimary() {
+    switch (CurTok.Kind) {
+        default:
+            return LogError("unknown token, expecting expression");
+        case tok_identifier:
+          return ParseIdentifierExpr();
+        case tok_number:
+          return ParseNumberExpr();
+        case '(':
+          return ParseParenExpr();
+        case tok_if:
+          return ParseIfExpr();
+        case tok_for:
+          return ParseForExpr();
+        case tok_var:
+          return ParseVarExpr();
+    }
+}
+
+// GetTokPrecedence - Get the precedence of the pending binary operator
+// token.
+int Parser::GetTokPrecedence() {
+    if (!isascii(CurTok.Kind))
+        return -1;
+
+    // Is it a valid binary operation.
+    int TokPrec = BinopPrecedence[CurTok.Kind];
+    if (TokPrec <= 0) return -1;
+    return TokPrec;
+}
+
+// Parse binary operation right hand side. This is operator precedence
+// parsing with explicit operand and operator stacks (shunting-yard), so that
+// the stack depth doesn't grow with the length of the expression.
+ExprId Parser::ParseBinOpRHS(int ExprPrec, ExprId LHS) {
+    // Operands[i] and Operands[i + 1] are the sides of Ops[i], operators on
+    // the stack have strictly increasing precedence.
+    SmallVector<ExprId, 16> Operands = {LHS};
+    SmallVector<std::pair<int, int>, 16> Ops; // Operator and its precedence.
+
+    // Build the nodes for the operators on the stack that bind at least as
+    // tightly as Prec.
+    auto Reduce = [&](int Prec) {
+        while (!Ops.empty() && Ops.back().second >= Prec) {
+            ExprId RHS = Operands.pop_back_val();
+            Operands.back() = Nodes.addBinary(Ops.back().first,
+                    Operands.back(), RHS);
+            Ops.pop_back();
+        }
+    };
+
+    while (true) {
+        int TokPrec = GetTokPrecedence();
+
+        if (TokPrec < ExprPrec)
+            break;
+        int BinOp = CurTok.Kind;
+        SourceLocation OpLoc = CurTok.Loc;
+        getNextToken();
+
+        ExprId RHS = ParsePrimary();
+        if (RHS == NoExpr)
+            return NoExpr;
+
+        // Operators are left associative, fold everything of the same or
+        // higher precedence before pushing this one. Assignment is right
+        // associative, "a = b = c" leaves "a =" on the stack.
+        Reduce(BinOp == '=' ? TokPrec + 1 : TokPrec);
+        if (BinOp == '=' &&
+            Nodes.getKind(Operands.back()) != ExprPool::EK_Variable)
+            return LogErrorAt(OpLoc, "destination of '=' must be a variable");
+        Ops.push_back({BinOp, TokPrec});
+        Operands.push_back(RHS);
+    }
+
+    Reduce(ExprPrec);
+    return Operands.front();
+}
+
+// Parse expression implementation.
+ExprId Parser::ParseExpression() {
+    ExprId LHS = ParsePrimary();
+    if (LHS == NoExpr)
+        return NoExpr;
+
+    return ParseBinOpRHS(0, LHS);
+}
+
+
+// Parse prototype functions.
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
+    if (CurTok.Kind != tok_identifier)
+        return LogErrorP("Expected function name in prototype");
+
+    Symbol FnName = CurTok.Sym;
+    getNextToken();
+
+    if (CurTok.Kind != '(')
+        return LogErrorP("Expected '(' in prototype");
+
+    std::vector<Symbol> ArgNames;
+    while (getNextToken() == tok_identifier)
+        ArgNames.push_back(CurTok.Sym);
+    if (CurTok.Kind != ')')
+        return LogErrorP("Expected ')' in prototype");
+
+    getNextToken();
+
+    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+}
+
+// Parse function definitions, "memo def" memoizes the function.
+std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
+    bool Memo = CurTok.Kind == tok_memo;
+    if (Memo && getNextToken() != tok_def) {
+        LogError("expected 'def' after 'memo'");
+        return nullptr;
+    }
+    getNextToken();
+    auto Proto = ParsePrototype();
+    if (!Proto) return nullptr;
+
+    BeginFunctionScope(Proto->getArgs());
+    ExprId E = ParseExpression();
+    if (E == NoExpr)
+        return nullptr;
+    return std::make_unique<FunctionAST>(std::move(Proto), Nodes, E,
+            NumScopeSlots, Memo);
+}
+
+// Parse extern expressions.
+std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
+    getNextToken();
+    return ParsePrototype();
+}
+
+// Parse top level expression.
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+    BeginFunctionScope({});
+    ExprId E = ParseExpression();
+    if (E == NoExpr)
+        return nullptr;
+    auto Proto = std::make_unique<PrototypeAST>(AnonExprSym,
+            std::vector<Symbol>());
+    return std::make_unique<FunctionAST>(std::move(Proto), Nodes, E,
+            NumScopeSlots);
+}
+
+// LLVM code generation.
+
+// CodeGen - Generates IR for what the parser reads, into one module at a time.
+// Functions of earlier modules are re-declared from their prototypes when
+// they are called.
+class CodeGen {
+    public:
+    const SymbolTable &Symbols;
+    FastMathFlags FMF; // Put on every floating point operation.
+
+    std::unique_ptr<LLVMContext> TheContext;
+    std::unique_ptr<Module> TheModule;
+    std::unique_ptr<IRBuilder<>> Builder;
+    // Stack slots of the variables of the function being generated, by slot
+    // number. Variables are mutable so they live in memory, the optimizer
+    // turns them back into SSA registers.
+    SmallVector<AllocaInst *, 8> NamedValues;
+    // Prototypes of every extern and definition seen so far, whatever module
+    // they were compiled in, indexed by symbol.
+    std::vector<std::unique_ptr<PrototypeAST>> FunctionProtos;
+    // Functions whose body has already been handed to the JIT, by symbol.
+    BitVector DefinedFunctions;
+    // Definitions still to come, by symbol, when several files are compiled
+    // as one program: calls may be generated before the definition is.
+    BitVector PendingDefinitions;
+    // Externs that definitions call as a math intrinsic, by symbol. Those
+    // calls can't be pointed at a definition of the same name later on.
+    BitVector IntrinsicCallees;
+    // Declarations of functions in the current module, by symbol.
+    // ModuleSymbols lists the entries that are set so that starting a new
+    // module only has to reset those.
+    std::vector<Function *> ModuleFunctions;
+    std::vector<Symbol> ModuleSymbols;
+    // Definitions that only compute a value from their arguments, by symbol:
+    // they call no externs and no functions that aren't pure themselves.
+    BitVector PureFunctions;
+    // Definitions declared with "memo def", by symbol.
+    BitVector MemoFunctions;
+    // The functions each definition calls, by symbol, sorted. Redefining a
+    // function only affects what depends on it through these.
+    std::vector<std::vector<Symbol>> FunctionCallees;
+    // The definition being generated, whether it's pure so far, and what it
+    // calls.
+    Symbol CurFunction = 0;
+    bool CurFunctionPure = true;
+    std::vector<Symbol> CurCallees;
+    // Whether definitions can be replaced, which takes the JIT calling them
+    // through stubs.
+    bool AllowRedefinition = false;
+    unsigned NumErrors = 0; // Errors logged so far.
+    // The nodes of the function being generated.
+    const ExprPool *Nodes = nullptr;
+    // Top-level expressions are functions of this name, and aren't profiled.
+    Symbol AnonExprSym = 0;
+
+    // With Instrument, the counters of every definition (laid out as in a
+    // Profile row), which the generated code adds to in place: a deque never
+    // moves them. By symbol, where the counters of the current definition
+    // start and how many there are.
+    bool Instrument = false;
+    std::deque<uint64_t> Counters;
+    std::vector<std::pair<size_t, unsigned>> FunctionCounters;
+    bool CurInstrumented = false;
+    // The profile to optimize with, if any, and the row of the definition
+    // being generated with how much of it its ifs and loops have used up.
+    const Profile *PGO = nullptr;
+    ArrayRef<uint64_t> CurProfile;
+    unsigned CurProfileUsed = 0;
+
+    // Memoized functions keep the results of their last calls in a table of
+    // this many entries, indexed by a hash of the arguments.
+    static constexpr unsigned MemoTableSize = 1024;
+
+    explicit CodeGen(const SymbolTable &Symbols) : Symbols(Symbols) {}
+
+    Value *LogErrorV(const char *Str);
+    Function *getFunction(Symbol Name);
+    AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+            StringRef VarName);
+    bool isPure(Symbol Name) const {
+        return Name < PureFunctions.size() && PureFunctions[Name];
+    }
+    bool isMemo(Symbol Name) const {
+        return Name < MemoFunctions.size() && MemoFunctions[Name];
+    }
+    // Whether Name is, or is about to be, one of the program's definitions
+    // rather than an extern.
+    bool hasDefinition(Symbol Name) const {
+        return (Name < DefinedFunctions.size() && DefinedFunctions[Name]) ||
+               (Name < PendingDefinitions.size() && PendingDefinitions[Name]);
+    }
+    // The intrinsic a call of Name with NumArgs arguments is lowered to, if
+    // Name is an extern of one of the C library's math functions. Intrinsics
+    // don't set errno, so the optimizer can fold, hoist and vectorize them
+    // like any other arithmetic.
+    Intrinsic::ID getMathIntrinsic(Symbol Name, unsigned NumArgs) const;
+    // The definitions that call Name, directly or not.
+    std::vector<Symbol> getDependents(Symbol Name) const;
+    // Work out again which of Dependents are pure, after a function they
+    // depend on was redefined.
+    void updatePurity(ArrayRef<Symbol> Dependents);
+
+    // Start the body of the memoized function F by looking its arguments up
+    // in its memo table, returning the result found there if any. Returns
+    // the table entry the result goes in otherwise, for emitMemoStore().
+    Value *emitMemoLookup(Function *F);
+    void emitMemoStore(Function *F, Value *Entry, Value *Result);
+
+    // Counters of the definition being generated. Reserve N of them,
+    // returning the index of the first, and emit code adding one to a
+    // counter. Neither does anything unless the definition is instrumented.
+    size_t addCounters(unsigned N);
+    void emitIncrement(size_t Counter);
+    // The branch weights of a conditional branch, from the two profile
+    // counters at At: those of the then and else arms of an if, or the
+    // iterations and exits of a loop. Null without counts.
+    MDNode *getBranchWeights(unsigned At, bool Loop);
+
+    // Generate the value of the expression E in Nodes.
+    Value *codegenExpr(ExprId E);
+    Value *codegenBinary(ExprId E);
+    // Emit the binary operator E itself once its operands have been
+    // generated, L is null for assignment since the LHS isn't evaluated.
+    Value *codegenBinaryOp(ExprId E, Value *L, Value *R);
+    Value *codegenCall(ExprId E);
+    Value *codegenIf(ExprId E);
+    Value *codegenFor(ExprId E);
+    Value *codegenVar(ExprId E);
+};
+
+// Log a code generation error, the parser has already moved past the
+// offending code so there is no useful location to report.
+Value *CodeGen::LogErrorV(const char *Str) {
+    ++NumErrors;
+    fprintf(stderr, "Error: %s\n", Str);
+    return nullptr;
+}
+
+// Get a declaration of the function Name in the current module, emitting one
+// from its recorded prototype if the function lives in an earlier module.
+Function *CodeGen::getFunction(Symbol Name) {
+    // First, see if the function has already been added to the current
+    // module.
+    if (Name < ModuleFunctions.size() && ModuleFunctions[Name])
+        return ModuleFunctions[Name];
+
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype.
+    if (Name < FunctionProtos.size() && FunctionProtos[Name])
+        return FunctionProtos[Name]->codegen(*this);
+
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+Intrinsic::ID CodeGen::getMathIntrinsic(Symbol Name, unsigned NumArgs) const {
+    // Only externs, a definition of the same name is a function of its own,
+    // even if it hasn't been generated yet.
+    if (Name >= FunctionProtos.size() || !FunctionProtos[Name] ||
+        Name == CurFunction || hasDefinition(Name))
+        return Intrinsic::not_intrinsic;
+    auto [ID, Arity] =
+        StringSwitch<std::pair<Intrinsic::ID, unsigned>>(Symbols.getName(Name))
+            .Case("sin", {Intrinsic::sin, 1})
+            .Case("cos", {Intrinsic::cos, 1})
+            .Case("exp", {Intrinsic::exp, 1})
+            .Case("log", {Intrinsic::log, 1})
+            .Case("sqrt", {Intrinsic::sqrt, 1})
+            .Case("fabs", {Intrinsic::fabs, 1})
+            .Case("pow", {Intrinsic::pow, 2})
+            .Default({Intrinsic::not_intrinsic, 0});
+    return Arity == NumArgs && FunctionProtos[Name]->getArgs().size() == Arity
+               ? ID
+               : Intrinsic::not_intrinsic;
+}
+
+std::vector<Symbol> CodeGen::getDependents(Symbol Name) const {
+    std::vector<Symbol> Dependents;
+    BitVector Seen(std::max<size_t>(FunctionCallees.size(), Name + 1));
+    Seen.set(Name);
+    // Breadth first over the callers, Dependents doubles as the worklist.
+    for (size_t I = 0; ; ++I) {
+        for (Symbol Caller = 0; Caller != FunctionCallees.size(); ++Caller)
+            if (!Seen[Caller] && Caller < DefinedFunctions.size() &&
+                DefinedFunctions[Caller] &&
+                is_contained(FunctionCallees[Caller], Name)) {
+                Seen.set(Caller);
+                Dependents.push_back(Caller);
+            }
+        if (I == Dependents.size())
+            return Dependents;
+        Name = Dependents[I];
+    }
+}
+
+void CodeGen::updatePurity(ArrayRef<Symbol> Dependents) {
+    // A definition is pure if everything else it calls is, starting from
+    // none of them being pure so that cycles between them aren't.
+    for (Symbol D : Dependents)
+        if (D < PureFunctions.size())
+            PureFunctions.reset(D);
+    bool Changed = true;
+    while (Changed) {
+        Changed = false;
+        for (Symbol D : Dependents) {
+            if (isPure(D) || !all_of(FunctionCallees[D], [&](Symbol C) {
+                    return C == D || isPure(C);
+                }))
+                continue;
+            if (D >= PureFunctions.size())
+                PureFunctions.resize(D + 1);
+            PureFunctions.set(D);
+            Changed = true;
+        }
+    }
+}
+
+// Create an alloca instruction in the entry block of the function, for a
+// mutable variable.
+AllocaInst *CodeGen::CreateEntryBlockAlloca(Function *TheFunction,
+        StringRef VarName) {
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+            TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr,
+            VarName);
+}
+
+// The memo table of F: MemoTableSize entries of {argument bits, result,
+// valid}, zero initialized so that every entry starts out invalid.
+static GlobalVariable *getMemoTable(Function *F, StructType *&EntryTy) {
+    LLVMContext &Ctx = F->getContext();
+    EntryTy = StructType::get(
+        ArrayType::get(Type::getInt64Ty(Ctx), F->arg_size()),
+        Type::getDoubleTy(Ctx), Type::getInt8Ty(Ctx));
+    std::string Name = (F->getName() + ".memo").str();
+    Module &M = *F->getParent();
+    if (auto *Table = M.getNamedGlobal(Name))
+        return Table;
+    auto *TableTy = ArrayType::get(EntryTy, CodeGen::MemoTableSize);
+    return new GlobalVariable(M, TableTy, /*isConstant=*/false,
+            GlobalValue::InternalLinkage, Constant::getNullValue(TableTy),
+            Name);
+}
+
+Value *CodeGen::emitMemoLookup(Function *F) {
+    StructType *EntryTy;
+    GlobalVariable *Table = getMemoTable(F, EntryTy);
+    LLVMContext &Ctx = *TheContext;
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+    // Hash the bits of the arguments, the top bits of the hash pick the
+    // entry.
+    Value *Hash = ConstantInt::get(Int64Ty, 0);
+    for (auto &Arg : F->args()) {
+        Hash = Builder->CreateXor(Hash, Builder->CreateBitCast(&Arg, Int64Ty));
+        Hash = Builder->CreateXor(Hash, Builder->CreateLShr(Hash, 29));
+        Hash = Builder->CreateMul(Hash,
+                ConstantInt::get(Int64Ty, 0x9e3779b97f4a7c15ULL));
+    }
+    Value *Idx = Builder->CreateLShr(Hash, 64 - Log2_32(MemoTableSize),
+            "memo.idx");
+    Value *Entry = Builder->CreateInBoundsGEP(Table->getValueType(), Table,
+            {ConstantInt::get(Int64Ty, 0), Idx}, "memo.entry");
+
+    // The entry holds our result if it's valid and for the same arguments,
+    // bit for bit.
+    Value *Hit = Builder->CreateICmpNE(
+        Builder->CreateLoad(Type::getInt8Ty(Ctx),
+                Builder->CreateStructGEP(EntryTy, Entry, 2)),
+        ConstantInt::get(Type::getInt8Ty(Ctx), 0), "memo.valid");
+    Value *Keys = Builder->CreateStructGEP(EntryTy, Entry, 0);
+    for (auto &Arg : F->args()) {
+        Value *Key = Builder->CreateLoad(Int64Ty,
+                Builder->CreateConstInBoundsGEP2_32(EntryTy->getElementType(0),
+                        Keys, 0, Arg.getArgNo()));
+        Hit = Builder->CreateAnd(Hit, Builder->CreateICmpEQ(Key,
+                Builder->CreateBitCast(&Arg, Int64Ty)));
+    }
+
+    BasicBlock *HitBB = BasicBlock::Create(Ctx, "memo.hit", F);
+    BasicBlock *MissBB = BasicBlock::Create(Ctx, "memo.miss", F);
+    Builder->CreateCondBr(Hit, HitBB, MissBB);
+    Builder->SetInsertPoint(HitBB);
+    Builder->CreateRet(Builder->CreateLoad(Type::getDoubleTy(Ctx),
+            Builder->CreateStructGEP(EntryTy, Entry, 1), "memo.result"));
+    Builder->SetInsertPoint(MissBB);
+    return Entry;
+}
+
+void CodeGen::emitMemoStore(Function *F, Value *Entry, Value *Result) {
+    StructType *EntryTy;
+    getMemoTable(F, EntryTy);
+    LLVMContext &Ctx = *TheContext;
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+    // Calls made while computing Result may have taken the entry over, so
+    // the arguments go in again along with it.
+    Value *Keys = Builder->CreateStructGEP(EntryTy, Entry, 0);
+    for (auto &Arg : F->args())
+        Builder->CreateStore(Builder->CreateBitCast(&Arg, Int64Ty),
+                Builder->CreateConstInBoundsGEP2_32(EntryTy->getElementType(0),
+                        Keys, 0, Arg.getArgNo()));
+    Builder->CreateStore(Result, Builder->CreateStructGEP(EntryTy, Entry, 1));
+    Builder->CreateStore(ConstantInt::get(Type::getInt8Ty(Ctx), 1),
+            Builder->CreateStructGEP(EntryTy, Entry, 2));
+}
+
+// Code gen for expressions, by kind of node.
+Value *CodeGen::codegenExpr(ExprId E) {
+    switch (Nodes->getKind(E)) {
+    case ExprPool::EK_Number:
+        return ConstantFP::get(*TheContext, APFloat(Nodes->getVal(E)));
+    case ExprPool::EK_Variable: {
+        // The parser resolved the variable to its slot, load the value.
+        AllocaInst *A = NamedValues[Nodes->getSlot(E)];
+        return Builder->CreateLoad(A->getAllocatedType(), A,
+                Symbols.getName(Nodes->getName(E)));
+    }
+    case ExprPool::EK_Binary:
+        return codegenBinary(E);
+    case ExprPool::EK_Call:
+        return codegenCall(E);
+    case ExprPool::EK_If:
+        return codegenIf(E);
+    case ExprPool::EK_For:
+        return codegenFor(E);
+    case ExprPool::EK_Var:
+        return codegenVar(E);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+// Code gen for binary expressions, a post-order walk over the tree of binary
+// operators rooted at E. Operands that aren't binary operators are generated
+// by codegenExpr().
+Value *CodeGen::codegenBinary(ExprId E) {
+    struct Frame {
+        ExprId E;
+        Value *L; // Value of the LHS, once generated.
+        unsigned NumDone; // Number of operands generated so far.
+    };
+    SmallVector<Frame, 16> Stack = {{E, nullptr, 0}};
+    Value *Result = nullptr; // Value of the last completed subtree.
+
+    while (true) {
+        Frame &F = Stack.back();
+        ExprId Operand;
+        if (F.NumDone == 0 && Nodes->getOp(F.E) == '=') {
+            // Assignment only evaluates the RHS.
+            F.NumDone = 1;
+            Operand = Nodes->getRHS(F.E);
+        } else if (F.NumDone == 0) {
+            Operand = Nodes->getLHS(F.E);
+        } else if (F.NumDone == 1) {
+            F.L = Result;
+            Operand = Nodes->getRHS(F.E);
+        } else {
+            Result = codegenBinaryOp(F.E, F.L, Result);
+            Stack.pop_back();
+            if (Stack.empty())
+                return Result;
+            continue;
+        }
+        ++F.NumDone;
+
+        if (Nodes->getKind(Operand) == ExprPool::EK_Binary)
+            Stack.push_back({Operand, nullptr, 0});
+        else
+            Result = codegenExpr(Operand);
+    }
+}
+
+Value *CodeGen::codegenBinaryOp(ExprId E, Value *L, Value *R) {
+    char Op = Nodes->getOp(E);
+    if (Op == '=') {
+        if (!R)
+            return nullptr;
+        // Store the value and return it, so assignments can be chained.
+        Builder->CreateStore(R,
+                NamedValues[Nodes->getSlot(Nodes->getLHS(E))]);
+        return R;
+    }
+
+    if (!L || !R)
+        return nullptr;
+
+    switch (Op) {
+        case '+':
+            return Builder->CreateFAdd(L, R, "addtmp");
+        case '-':
+            return Builder->CreateFSub(L, R, "subtmp");
+        case '*':
+            return Builder->CreateFMul(L, R, "multmp");
+        case '<':
+            L = Builder->CreateFCmpULT(L, R, "cmptmp");
+            return Builder->CreateUIToFP(L,
+                    Type::getDoubleTy(*TheContext), "booltmp");
+        default:
+            return LogErrorV("invalid binary operator");
+    }
+}
+
+// Code gen for function calls.
+Value *CodeGen::codegenCall(ExprId E) {
+    Symbol Callee = Nodes->getCallee(E);
+    ArrayRef<ExprId> Args = Nodes->getArgs(E);
+    // Math functions have no side effects to make the caller impure.
+    if (Intrinsic::ID ID = getMathIntrinsic(Callee, Args.size())) {
+        SmallVector<Value *, 2> ArgsV;
+        for (ExprId Arg : Args) {
+            ArgsV.push_back(codegenExpr(Arg));
+            if (!ArgsV.back())
+                return nullptr;
+        }
+        ++NumMathIntrinsics;
+        // Top-level expressions are gone once they have run.
+        if (CurFunction != AnonExprSym) {
+            if (Callee >= IntrinsicCallees.size())
+                IntrinsicCallees.resize(Callee + 1);
+            IntrinsicCallees.set(Callee);
+        }
+        return Builder->CreateIntrinsic(ID, {Type::getDoubleTy(*TheContext)},
+                ArgsV, nullptr, "calltmp");
+    }
+
+    // Look up the name in the global function table.
+    Function *CalleeF = getFunction(Callee);
+    if (!CalleeF)
+        return LogErrorV("Unknown function referenced");
+    if (CalleeF->arg_size() != Args.size())
+        return LogErrorV("Incorrect number of arguments passed");
+    // Recursive calls don't make a definition any less pure.
+    if (Callee != CurFunction && !isPure(Callee))
+        CurFunctionPure = false;
+    CurCallees.push_back(Callee);
+
+    std::vector<Value *> ArgsV;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+        ArgsV.push_back(codegenExpr(Args[i]));
+        if (!ArgsV.back())
+            return nullptr;
+    }
+
+    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+size_t CodeGen::addCounters(unsigned N) {
+    size_t At = Counters.size();
+    if (CurInstrumented)
+        Counters.resize(At + N);
+    return At;
+}
+
+void CodeGen::emitIncrement(size_t Counter) {
+    if (!CurInstrumented)
+        return;
+    // Straight to the counter's address, the code only runs in this process.
+    Type *Int64Ty = Builder->getInt64Ty();
+    Constant *Ptr = ConstantExpr::getIntToPtr(
+            Builder->getInt64(reinterpret_cast<uintptr_t>(&Counters[Counter])),
+            PointerType::getUnqual(Int64Ty));
+    Value *Count = Builder->CreateLoad(Int64Ty, Ptr, "count");
+    Builder->CreateStore(Builder->CreateAdd(Count, Builder->getInt64(1)), Ptr);
+}
+
+MDNode *CodeGen::getBranchWeights(unsigned At, bool Loop) {
+    if (At + 2 > CurProfile.size())
+        return nullptr;
+    uint64_t Taken = CurProfile[At], NotTaken = CurProfile[At + 1];
+    // Every time the loop is entered it runs once without taking the back
+    // edge, and then leaves.
+    if (Loop)
+        Taken = Taken > NotTaken ? Taken - NotTaken : 0;
+    if (!Taken && !NotTaken)
+        return nullptr;
+    // Weights only have 32 bits.
+    uint64_t Scale = std::max(Taken, NotTaken) / UINT32_MAX + 1;
+    return MDBuilder(*TheContext).createBranchWeights(Taken / Scale,
+                                                      NotTaken / Scale);
+}
+
+// Code gen for if/then/else, the value of the expression is a phi of the
+// values of the two arms.
+Value *CodeGen::codegenIf(ExprId E) {
+    // The counters go in the order of the ifs and loops in the source, this
+    // one's before those of its condition.
+    size_t CountersAt = addCounters(2);
+    unsigned ProfileAt = std::exchange(CurProfileUsed, CurProfileUsed + 2);
+    Value *CondV = codegenExpr(Nodes->getCond(E));
+    if (!CondV)
+        return nullptr;
+
+    // Convert condition to a bool by comparing non-equal to 0.0.
+    CondV = Builder->CreateFCmpONE(
+        CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    // Create blocks for the then and else cases. Insert the 'then' block at
+    // the end of the function.
+    BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then",
+            TheFunction);
+    BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+    BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+
+    Builder->CreateCondBr(CondV, ThenBB, ElseBB,
+                          getBranchWeights(ProfileAt, /*Loop=*/false));
+
+    // Emit then value.
+    Builder->SetInsertPoint(ThenBB);
+    emitIncrement(CountersAt);
+    Value *ThenV = codegenExpr(Nodes->getThen(E));
+    if (!ThenV)
+        return nullptr;
+    Builder->CreateBr(MergeBB);
+    // Codegen of 'Then' can change the current block, update ThenBB for the
+    // PHI.
+    ThenBB = Builder->GetInsertBlock();
+
+    // Emit else block.
+    TheFunction->getBasicBlockList().push_back(ElseBB);
+    Builder->SetInsertPoint(ElseBB);
+    emitIncrement(CountersAt + 1);
+    Value *ElseV = codegenExpr(Nodes->getElse(E));
+    if (!ElseV)
+        return nullptr;
+    Builder->CreateBr(MergeBB);
+    // Codegen of 'Else' can change the current block, update ElseBB for the
+    // PHI.
+    ElseBB = Builder->GetInsertBlock();
+
+    // Emit merge block.
+    TheFunction->getBasicBlockList().push_back(MergeBB);
+    Builder->SetInsertPoint(MergeBB);
+    PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2,
+            "iftmp");
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
+}
+
+// Code gen for for/in, which always evaluates to 0.0. The loop variable is
+// mutable like any other and lives in a stack slot, the optimizer turns it
+// back into a phi in the loop header:
+//
+//   entry:
+//     var = alloca double
+//     start = startexpr
+//     store start -> var
+//     br loop
+//   loop:
+//     bodyexpr
+//   loopend:
+//     step = stepexpr
+//     endcond = endexpr
+//     curvar = load var
+//     nextvar = curvar + step
+//     store nextvar -> var
+//     br endcond, loop, afterloop
+//   afterloop:
+Value *CodeGen::codegenFor(ExprId E) {
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    StringRef VarName = Symbols.getName(Nodes->getName(E));
+    size_t CountersAt = addCounters(2);
+    unsigned ProfileAt = std::exchange(CurProfileUsed, CurProfileUsed + 2);
+
+    // Create an alloca for the variable in the entry block.
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+
+    // Emit the start code first, without 'variable' in scope.
+    Value *StartVal = codegenExpr(Nodes->getStart(E));
+    if (!StartVal)
+        return nullptr;
+
+    // Store the value into the alloca.
+    Builder->CreateStore(StartVal, Alloca);
+
+    // Make the new basic block for the loop header, inserting after current
+    // block.
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop",
+            TheFunction);
+
+    // Insert an explicit fall through from the current block to the LoopBB.
+    Builder->CreateBr(LoopBB);
+
+    // Start insertion in LoopBB.
+    Builder->SetInsertPoint(LoopBB);
+    emitIncrement(CountersAt);
+
+    // The loop variable has a slot of its own, so there's no outer variable
+    // of the same name to restore afterwards.
+    NamedValues[Nodes->getSlot(E)] = Alloca;
+
+    // Emit the body of the loop. This, like any other expr, can change the
+    // current BB. Note that we ignore the value computed by the body.
+    if (!codegenExpr(Nodes->getBody(E)))
+        return nullptr;
+
+    // Emit the step value.
+    Value *StepVal = nullptr;
+    if (Nodes->getStep(E) != NoExpr) {
+        StepVal = codegenExpr(Nodes->getStep(E));
+        if (!StepVal)
+            return nullptr;
+    } else {
+        // If not specified, use 1.0.
+        StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+    }
+
+    // Compute the end condition.
+    Value *EndCond = codegenExpr(Nodes->getEnd(E));
+    if (!EndCond)
+        return nullptr;
+
+    // Reload, increment, and restore the alloca. This handles the case where
+    // the body of the loop mutates the variable.
+    Value *CurVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca,
+            VarName);
+    Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+    Builder->CreateStore(NextVar, Alloca);
+
+    // Convert condition to a bool by comparing non-equal to 0.0.
+    EndCond = Builder->CreateFCmpONE(
+        EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+
+    // Create the "after loop" block and insert it.
+    BasicBlock *AfterBB =
+        BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+
+    // Insert the conditional branch into the end of LoopEndBB.
+    Builder->CreateCondBr(EndCond, LoopBB, AfterBB,
+                          getBranchWeights(ProfileAt, /*Loop=*/true));
+
+    // Any new code will be inserted in AfterBB.
+    Builder->SetInsertPoint(AfterBB);
+    emitIncrement(CountersAt + 1);
+
+    // for expr always returns 0.0.
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+}
+
+// Code gen for var/in, the variables are initialized in order and stay in
+// scope for the body, whose value is the value of the expression.
+Value *CodeGen::codegenVar(ExprId E) {
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    // Register all variables and emit their initializer.
+    for (const ExprPool::Binding &Var : Nodes->getVars(E)) {
+        // Emit the initializer before adding the variable to scope, this
+        // prevents the initializer from referencing the variable itself.
+        Value *InitVal;
+        if (Var.Init != NoExpr) {
+            InitVal = codegenExpr(Var.Init);
+            if (!InitVal)
+                return nullptr;
+        } else { // If not specified, use 0.0.
+            InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
+        }
+
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction,
+                Symbols.getName(Var.Name));
+        Builder->CreateStore(InitVal, Alloca);
+        NamedValues[Var.Slot] = Alloca;
+    }
+
+    // Codegen the body, now that all vars are in scope.
+    return codegenExpr(Nodes->getBody(E));
+}
+
+// Code gen for function prototypes.
+Function *PrototypeAST::codegen(CodeGen &CG) {
+    // Declare the function type.
+    std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*CG.TheContext));
+    FunctionType *FT =
+        FunctionType::get(Type::getDoubleTy(*CG.TheContext), Doubles, false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage,
+            CG.Symbols.getName(Name), CG.TheModule.get());
+    unsigned Idx = 0;
+    for (auto &Arg : F->args())
+        Arg.setName(CG.Symbols.getName(Args[Idx++]));
+    // A definition named like a C library function, "def sin(x) ...", isn't
+    // it: the optimizer mustn't fold or replace calls of it as if it were.
+    if (CG.hasDefinition(Name))
+        F->addFnAttr(Attribute::NoBuiltin);
+
+    Function *&Entry = symbolEntry(CG.ModuleFunctions, Name);
+    if (!Entry)
+        CG.ModuleSymbols.push_back(Name);
+    Entry = F;
+    return F;
+}
+
+// Code gen for function bodies.
+Function *FunctionAST::codegen(CodeGen &CG) {
+    // Transfer ownership of the prototype to CG.FunctionProtos, but keep a
+    // reference to it for use below.
+    auto &P = *Proto;
+    Symbol Name = P.getSymbol();
+    bool Redefining =
+        Name < CG.DefinedFunctions.size() && CG.DefinedFunctions[Name];
+    // Its callers were compiled for the C library's function.
+    if (Name < CG.IntrinsicCallees.size() && CG.IntrinsicCallees[Name])
+        return (Function*)CG.LogErrorV(
+                "Function is already called as a math intrinsic, it cannot "
+                "be defined.");
+    if (Redefining) {
+        // Batch kernels have no prototype, they go with their definition.
+        if (!CG.AllowRedefinition || Name >= CG.FunctionProtos.size() ||
+            !CG.FunctionProtos[Name])
+            return (Function*)CG.LogErrorV("Function cannot be redefined.");
+        // Callers were compiled for the old number of arguments.
+        if (CG.FunctionProtos[Name]->getArgs().size() != P.getArgs().size())
+            return (Function*)CG.LogErrorV(
+                    "Function redefined with a different number of arguments.");
+    }
+    // The previous definition stays if this one has errors.
+    std::unique_ptr<PrototypeAST> OldProto =
+        std::move(symbolEntry(CG.FunctionProtos, Name));
+    CG.FunctionProtos[Name] = std::move(Proto);
+    Function *TheFunction = CG.getFunction(Name);
+    // Sanity checks.
+    if (!TheFunction)
+        return nullptr;
+    if (!TheFunction->empty())
+        return (Function*)CG.LogErrorV("Function cannot be redefined.");
+    // Not the C library's function, whatever its name.
+    TheFunction->addFnAttr(Attribute::NoBuiltin);
+
+    // Create a new IR block.
+    BasicBlock *BB = BasicBlock::Create(*CG.TheContext, "entry", TheFunction);
+    CG.Builder->SetInsertPoint(BB);
+
+    // Record function arguments, they take the first slots. Each one is
+    // copied into a stack slot so the body can assign to it.
+    CG.NamedValues.assign(NumSlots, nullptr);
+    for (auto &Arg: TheFunction->args()) {
+        AllocaInst *Alloca = CG.CreateEntryBlockAlloca(TheFunction,
+                Arg.getName());
+        CG.Builder->CreateStore(&Arg, Alloca);
+        CG.NamedValues[Arg.getArgNo()] = Alloca;
+    }
+    // The first counter counts the calls.
+    CG.CurInstrumented = CG.Instrument && Name != CG.AnonExprSym;
+    size_t CountersAt = CG.addCounters(1);
+    CG.emitIncrement(CountersAt);
+    CG.CurProfile = {};
+    if (CG.PGO)
+        CG.CurProfile = CG.PGO->lookup(CG.Symbols.getName(Name));
+    CG.CurProfileUsed = 1;
+    if (!CG.CurProfile.empty())
+        TheFunction->setEntryCount(CG.CurProfile[0]);
+    Value *MemoEntry = Memo ? CG.emitMemoLookup(TheFunction) : nullptr;
+    CG.CurFunction = Name;
+    CG.CurFunctionPure = true;
+    CG.CurCallees.clear();
+    CG.Nodes = Nodes;
+    if (Value *RetVal = CG.codegenExpr(Body)) {
+        std::vector<Symbol> Dependents;
+        if (Redefining)
+            Dependents = CG.getDependents(Name);
+        if (Memo && !CG.CurFunctionPure) {
+            CG.LogErrorV("only pure functions can be memoized");
+        } else if (!CG.CurFunctionPure &&
+                   any_of(Dependents, [&](Symbol D) { return CG.isMemo(D); })) {
+            CG.LogErrorV("Memoized functions depend on this one, it has to "
+                         "stay pure.");
+        } else {
+            if (Memo)
+                CG.emitMemoStore(TheFunction, MemoEntry, RetVal);
+            // Insert return.
+            CG.Builder->CreateRet(RetVal);
+
+            if (!CG.CurProfile.empty() &&
+                CG.CurProfileUsed != CG.CurProfile.size()) {
+                // The definition changed since the profile was written.
+                fprintf(stderr, "Warning: the profile of %s doesn't match "
+                                "its definition, ignoring it\n",
+                        TheFunction->getName().str().c_str());
+                TheFunction->setMetadata(LLVMContext::MD_prof, nullptr);
+                for (BasicBlock &BB : *TheFunction)
+                    BB.getTerminator()->setMetadata(LLVMContext::MD_prof,
+                                                    nullptr);
+            }
+            if (CG.CurInstrumented)
+                symbolEntry(CG.FunctionCounters, Name) = {
+                    CountersAt, unsigned(CG.Counters.size() - CountersAt)};
+
+            // Validate the genereated code, the JIT optimizes it along with
+            // the rest of the module.
+            verifyFunction(*TheFunction);
+
+            if (Name >= CG.PureFunctions.size())
+                CG.PureFunctions.resize(Name + 1);
+            CG.PureFunctions[Name] = CG.CurFunctionPure;
+            if (Name >= CG.MemoFunctions.size())
+                CG.MemoFunctions.resize(Name + 1);
+            CG.MemoFunctions[Name] = Memo;
+            llvm::sort(CG.CurCallees);
+            CG.CurCallees.erase(
+                    std::unique(CG.CurCallees.begin(), CG.CurCallees.end()),
+                    CG.CurCallees.end());
+            symbolEntry(CG.FunctionCallees, Name) = std::move(CG.CurCallees);
+            CG.CurCallees.clear();
+            CG.updatePurity(Dependents);
+            return TheFunction;
+        }
+    }
+    // Error reading body, remove function and forget its prototype.
+    if (CG.CurInstrumented)
+        CG.Counters.resize(CountersAt);
+    std::string MemoTable = (TheFunction->getName() + ".memo").str();
+    TheFunction->eraseFromParent();
+    if (auto *Table = CG.TheModule->getNamedGlobal(MemoTable))
+        Table->eraseFromParent();
+    CG.ModuleFunctions[Name] = nullptr;
+    CG.FunctionProtos[Name] = std::move(OldProto);
+    return nullptr;
+}
+
+// Evaluate E if it's made of number literals and arithmetic only, with the
+// result the generated code would have. Operands are walked with an explicit
+// stack like in CodeGen::codegenBinary().
+static std::optional<double> foldConstant(const ExprPool &Nodes, ExprId E) {
+    SmallVector<std::pair<ExprId, bool>, 16> Work = {{E, false}};
+    SmallVector<double, 16> Values;
+    while (!Work.empty()) {
+        auto [N, Expanded] = Work.pop_back_val();
+        if (Nodes.getKind(N) == ExprPool::EK_Number) {
+            Values.push_back(Nodes.getVal(N));
+            continue;
+        }
+        if (Nodes.getKind(N) != ExprPool::EK_Binary || Nodes.getOp(N) == '=')
+            return std::nullopt;
+        if (!Expanded) {
+            // Come back once both operands are on Values, LHS first.
+            Work.push_back({N, true});
+            Work.push_back({Nodes.getRHS(N), false});
+            Work.push_back({Nodes.getLHS(N), false});
+            continue;
+        }
+        double R = Values.pop_back_val(), L = Values.pop_back_val();
+        switch (Nodes.getOp(N)) {
+            case '+': Values.push_back(L + R); break;
+            case '-': Values.push_back(L - R); break;
+            case '*': Values.push_back(L * R); break;
+            // Unordered or less than, like fcmp ult.
+            case '<': Values.push_back(!(L >= R) ? 1.0 : 0.0); break;
+            default: return std::nullopt;
+        }
+    }
+    return Values.back();
+}
+
+// BytecodeCompiler - Compiles a function body to Bytecode for the Interpreter.
+// Every subexpression leaves its value in a register: a variable's slot, a
+// constant, or the lowest free temporary, which are allocated and released
+// in stack order. Nested binary operators are walked with an explicit stack
+// like in CodeGen::codegenBinary().
+//
+// Top-level expressions run by the interpreter get no IR, so calls are
+// checked the way CodeGen::codegenCall() checks them.
+//
+// A profiled definition's bytecode adds to the same counters as its native
+// code, laid out the same way, so the profile counts what either tier ran.
+class BytecodeCompiler {
+    // Operands naming Consts[K] are ConstFlag | K until compile() knows
+    // where the constants go.
+    static constexpr uint32_t ConstFlag = 1u << 31;
+
+    CodeGen &CG;
+    const ExprPool &Nodes;
+    std::unique_ptr<Bytecode> BC;
+    DenseMap<uint64_t, uint32_t> ConstRegs; // By the bits of the constant.
+    unsigned NumSlots;
+    unsigned Top; // The next free temporary.
+    unsigned MaxTop;
+    // The first counter of the next if or loop, in Bytecode::Counters.
+    uint32_t NextCounter = 1;
+    bool Failed = false;
+
+    BytecodeCompiler(CodeGen &CG, const ExprPool &Nodes, unsigned NumSlots)
+        : CG(CG), Nodes(Nodes), BC(std::make_unique<Bytecode>()),
+          NumSlots(NumSlots), Top(NumSlots), MaxTop(NumSlots) {}
+
+    bool isTemp(uint32_t R) const { return !(R & ConstFlag) && R >= NumSlots; }
+    bool isSlot(uint32_t R) const { return !(R & ConstFlag) && R < NumSlots; }
+    // Expressions that can't change any variable when evaluated.
+    bool isSimple(ExprId E) const { return Nodes.isSimple(E); }
+
+    uint32_t constant(double Val) {
+        auto [I, New] = ConstRegs.try_emplace(DoubleToBits(Val),
+                ConstFlag | BC->Consts.size());
+        if (New)
+            BC->Consts.push_back(Val);
+        return I->second;
+    }
+    uint32_t allocTemp() {
+        MaxTop = std::max(MaxTop, Top + 1);
+        return Top++;
+    }
+    // Free R, and any temporary allocated after it, if it's a temporary.
+    void release(uint32_t R) {
+        if (isTemp(R))
+            Top = R;
+    }
+    size_t emit(Bytecode::Opcode Op, uint32_t A, uint32_t B = 0,
+            uint32_t C = 0) {
+        BC->Code.push_back({Op, A, B, C});
+        return BC->Code.size() - 1;
+    }
+    uint32_t fail() {
+        Failed = true;
+        return 0;
+    }
+    // As in CodeGen: reserve N counters, returning the index of the first,
+    // and emit code adding one to a counter if the function is profiled.
+    uint32_t addCounters(unsigned N) {
+        return std::exchange(NextCounter, NextCounter + N);
+    }
+    void emitCount(uint32_t Counter) {
+        if (Counter < BC->Counters.size())
+            emit(Bytecode::Count, Counter);
+    }
+
+    uint32_t compileExpr(ExprId E);
+    uint32_t compileBinary(ExprId E);
+    // Compile E into the lowest free temporary, which stays allocated.
+    uint32_t compileToTemp(ExprId E);
+
+    public:
+    // Compile the body of a function of NumArgs arguments and NumSlots
+    // variables. Counters is where its counters are in CG.Counters, as in
+    // CG.FunctionCounters, if it's profiled. Returns null after logging an
+    // error, or if it calls a function with more arguments than the
+    // interpreter can.
+    static std::unique_ptr<Bytecode> compile(CodeGen &CG,
+            const ExprPool &Nodes, ExprId Body, unsigned NumArgs,
+            unsigned NumSlots, std::pair<size_t, unsigned> Counters = {});
+};
+
+std::unique_ptr<Bytecode> BytecodeCompiler::compile(CodeGen &CG,
+        const ExprPool &Nodes, ExprId Body, unsigned NumArgs,
+        unsigned NumSlots, std::pair<size_t, unsigned> Counters) {
+    BytecodeCompiler C(CG, Nodes, NumSlots);
+    for (unsigned I = 0; I != Counters.second; ++I)
+        C.BC->Counters.push_back(&CG.Counters[Counters.first + I]);
+    // The first counter counts the calls.
+    C.emitCount(0);
+    uint32_t Result = C.compileExpr(Body);
+    if (C.Failed)
+        return nullptr;
+    C.emit(Bytecode::Ret, Result);
+    assert((!Counters.second || C.NextCounter == Counters.second) &&
+           "counters laid out unlike CodeGen's");
+
+    // The constants go after the temporaries.
+    Bytecode &BC = *C.BC;
+    BC.NumArgs = NumArgs;
+    BC.ConstBase = C.MaxTop;
+    BC.NumRegs = BC.ConstBase + BC.Consts.size();
+    for (Bytecode::Instr &I : BC.Code)
+        for (uint32_t *Operand : {&I.A, &I.B, &I.C})
+            if (*Operand & ConstFlag)
+                *Operand = BC.ConstBase + (*Operand & ~ConstFlag);
+    return std::move(C.BC);
+}
+
+uint32_t BytecodeCompiler::compileToTemp(ExprId E) {
+    uint32_t Dst = Top;
+    uint32_t R = compileExpr(E);
+    if (R != Dst)
+        emit(Bytecode::Move, Dst, R);
+    Top = Dst;
+    return allocTemp();
+}
+
+uint32_t BytecodeCompiler::compileExpr(ExprId E) {
+    if (Failed)
+        return 0;
+    switch (Nodes.getKind(E)) {
+    case ExprPool::EK_Number:
+        return constant(Nodes.getVal(E));
+
+    case ExprPool::EK_Variable:
+        return Nodes.getSlot(E);
+
+    case ExprPool::EK_Binary:
+        return compileBinary(E);
+
+    case ExprPool::EK_Call: {
+        Symbol Callee = Nodes.getCallee(E);
+        ArrayRef<ExprId> Args = Nodes.getArgs(E);
+        if (Callee >= CG.FunctionProtos.size() || !CG.FunctionProtos[Callee]) {
+            CG.LogErrorV("Unknown function referenced");
+            return fail();
+        }
+        if (CG.FunctionProtos[Callee]->getArgs().size() != Args.size()) {
+            CG.LogErrorV("Incorrect number of arguments passed");
+            return fail();
+        }
+        if (Args.size() > Interpreter::MaxNativeArgs)
+            return fail();
+
+        // The arguments go in consecutive temporaries, the result replaces
+        // the first.
+        uint32_t Base = Top;
+        for (ExprId Arg : Args)
+            compileToTemp(Arg);
+        Top = Base;
+        uint32_t Dst = allocTemp();
+        emit(Bytecode::Call, Dst, Args.size(), Callee);
+        return Dst;
+    }
+
+    case ExprPool::EK_If: {
+        uint32_t CountersAt = addCounters(2);
+        uint32_t Cond = compileExpr(Nodes.getCond(E));
+        size_t ToElse = emit(Bytecode::JumpIfFalse, Cond);
+        release(Cond);
+        emitCount(CountersAt);
+        // Both arms leave their value in the same temporary.
+        uint32_t Dst = compileToTemp(Nodes.getThen(E));
+        size_t ToEnd = emit(Bytecode::Jump, 0);
+        BC->Code[ToElse].B = BC->Code.size();
+        emitCount(CountersAt + 1);
+        Top = Dst;
+        compileToTemp(Nodes.getElse(E));
+        BC->Code[ToEnd].B = BC->Code.size();
+        return Dst;
+    }
+
+    case ExprPool::EK_For: {
+        // The same shape as in CodeGen::codegenFor(): the step and the end
+        // condition are evaluated after the body, before the increment.
+        uint32_t Slot = Nodes.getSlot(E);
+        uint32_t CountersAt = addCounters(2);
+        uint32_t Start = compileExpr(Nodes.getStart(E));
+        emit(Bytecode::Move, Slot, Start);
+        release(Start);
+
+        size_t Loop = BC->Code.size();
+        emitCount(CountersAt);
+        release(compileExpr(Nodes.getBody(E)));
+        uint32_t Step = Nodes.getStep(E) != NoExpr
+                            ? compileExpr(Nodes.getStep(E))
+                            : constant(1.0);
+        // The step is taken before the end condition, which may assign to
+        // the variable it was read from.
+        if (isSlot(Step) && !isSimple(Nodes.getEnd(E))) {
+            uint32_t T = allocTemp();
+            emit(Bytecode::Move, T, Step);
+            Step = T;
+        }
+        uint32_t EndCond = compileExpr(Nodes.getEnd(E));
+        // And the end condition is tested with the value from before the
+        // step, as the variable itself may be the condition.
+        if (isSlot(EndCond)) {
+            uint32_t T = allocTemp();
+            emit(Bytecode::Move, T, EndCond);
+            EndCond = T;
+        }
+        emit(Bytecode::Add, Slot, Slot, Step);
+        emit(Bytecode::LoopIfTrue, EndCond, Loop);
+        emitCount(CountersAt + 1);
+        release(EndCond);
+        release(Step);
+        return constant(0.0);
+    }
+
+    case ExprPool::EK_Var: {
+        for (const ExprPool::Binding &B : Nodes.getVars(E)) {
+            uint32_t Init = B.Init != NoExpr ? compileExpr(B.Init)
+                                             : constant(0.0);
+            emit(Bytecode::Move, B.Slot, Init);
+            release(Init);
+        }
+        return compileExpr(Nodes.getBody(E));
+    }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+uint32_t BytecodeCompiler::compileBinary(ExprId E) {
+    struct Frame {
+        ExprId E;
+        uint32_t L; // Register of the LHS, once compiled.
+        unsigned NumDone; // Number of operands compiled so far.
+    };
+    SmallVector<Frame, 16> Stack = {{E, 0, 0}};
+    uint32_t Result = 0; // Register of the last completed subtree.
+
+    while (true) {
+        if (Failed)
+            return 0;
+        Frame &F = Stack.back();
+        ExprId Operand;
+        if (F.NumDone == 0 && Nodes.getOp(F.E) == '=') {
+            // Assignment only evaluates the RHS.
+            F.NumDone = 1;
+            Operand = Nodes.getRHS(F.E);
+        } else if (F.NumDone == 0) {
+            Operand = Nodes.getLHS(F.E);
+        } else if (F.NumDone == 1) {
+            // Keep a variable's value from before the RHS assigns to it.
+            F.L = Result;
+            if (isSlot(F.L) && !isSimple(Nodes.getRHS(F.E))) {
+                F.L = allocTemp();
+                emit(Bytecode::Move, F.L, Result);
+            }
+            Operand = Nodes.getRHS(F.E);
+        } else {
+            char Op = Nodes.getOp(F.E);
+            if (Op == '=') {
+                emit(Bytecode::Move,
+                        Nodes.getSlot(Nodes.getLHS(F.E)),
+                        Result);
+            } else {
+                Bytecode::Opcode Opc;
+                switch (Op) {
+                case '+': Opc = Bytecode::Add; break;
+                case '-': Opc = Bytecode::Sub; break;
+                case '*': Opc = Bytecode::Mul; break;
+                case '<': Opc = Bytecode::Less; break;
+                default:
+                    CG.LogErrorV("invalid binary operator");
+                    return fail();
+                }
+                release(Result);
+                release(F.L);
+                uint32_t Dst = allocTemp();
+                emit(Opc, Dst, F.L, Result);
+                Result = Dst;
+            }
+            Stack.pop_back();
+            if (Stack.empty())
+                return Result;
+            continue;
+        }
+        ++F.NumDone;
+
+        if (Nodes.getKind(Operand) == ExprPool::EK_Binary)
+            Stack.push_back({Operand, 0, 0});
+        else
+            Result = compileExpr(Operand);
+    }
+}
+
+// KaleidoscopeSession::Impl - Everything a session knows: the symbols it has
+// interned, its lexer, parser and code generator, and the JIT it hands
+// modules to.
+class KaleidoscopeSession::Impl {
+  public:
+  CompilerOptions Opts;
+  SymbolTable Symbols;
+  Lexer Lex;
+  Parser P;
+  CodeGen CG;
+  std::unique_ptr<KaleidoscopeJIT> TheJIT;
+  // With Opts.Tiered, what runs new code until the JIT takes over.
+  std::unique_ptr<Interpreter> Interp;
+  // Unoptimized IR (as bitcode) of the module each definition was handed to
+  // the JIT in, by symbol, so batch kernels can inline definitions from
+  // earlier modules. The definitions of a whole file share theirs.
+  std::vector<std::shared_ptr<const SmallVector<char, 0>>> DefinitionBitcode;
+  // With Opts.WholeFile, what waits for the end of the source: the
+  // definitions in the current module, the batch kernels asked for them, and
+  // the functions top-level expressions were compiled into.
+  std::vector<Symbol> FileDefinitions;
+  std::vector<Symbol> FileKernels;
+  struct FileExpr {
+    std::string FnName; // Empty if the result is known already.
+    std::string ResultKey; // Where the result goes in ResultCache, if it does.
+    double Result;
+  };
+  std::vector<FileExpr> FileExprs;
+  // Results of top-level calls of pure definitions with constant arguments,
+  // by getResultKey(). Emptied when it gets to MaxCachedResults, so that a
+  // long session doesn't keep every result it ever computed.
+  StringMap<double> ResultCache;
+  static constexpr unsigned MaxCachedResults = 1 << 16;
+  void cacheResult(StringRef Key, double Result) {
+    if (ResultCache.size() >= MaxCachedResults) {
+      ++NumResultCacheFlushes;
+      ResultCache.clear();
+    }
+    ResultCache[Key] = Result;
+  }
+  // Without Opts.WholeFile, each definition goes to the JIT as a version of
+  // its own, "f.1", "f.2"..., reached through the stub "f". By symbol: the
+  // current version and what tracks its code and that of its batch kernel.
+  std::vector<unsigned> DefinitionVersions;
+  std::vector<ResourceTrackerSP> DefinitionTrackers;
+  std::vector<ResourceTrackerSP> KernelTrackers;
+  // Keeps the source given to compile() alive while it is lexed.
+  std::string CompileSource;
+  // With Opts.ProfileUse, the profile CG optimizes with and its summary,
+  // which every module gets for the optimizer to tell hot code from cold.
+  Profile PGO;
+  std::unique_ptr<ProfileSummary> PGOSummary;
+
+  explicit Impl(const CompilerOptions &Options)
+      : Opts(Options), Lex(Symbols), P(Lex, Symbols), CG(Symbols) {
+    CG.FMF = Opts.FMF;
+    CG.AllowRedefinition = !Opts.AheadOfTime && !Opts.WholeFile;
+    CG.AnonExprSym = Symbols.intern("__anon_expr");
+    CG.Instrument = Opts.ProfileGenerate;
+  }
+
+  void InitializeModule();
+
+  // Where the interpreter finds the native code of the function Sym: what the
+  // JIT has (or compiles) for it, or a symbol of the process for an extern.
+  Expected<JITTargetAddress> resolveForInterpreter(Symbol Sym);
+
+  // Handle one top-level item starting at the current token. Errors in the
+  // source are logged and skipped, only errors from the JIT are returned.
+  Error HandleDefinition();
+  Error HandleExtern();
+  Error HandleVectorize();
+  Error HandleTopLevelExpression();
+  Error HandleCommand();
+
+  // The same for an item that has been parsed already.
+  Error addDefinition(std::unique_ptr<FunctionAST> FnAST);
+  void addExtern(std::unique_ptr<PrototypeAST> ProtoAST);
+  Error addVectorize(Symbol Name);
+  Error runTopLevelExpr(std::unique_ptr<FunctionAST> FnAST);
+
+  // Compile the definition Name now rather than on its first call, in the
+  // background with compile threads. With DeferCompiles set, addDefinition()
+  // leaves that to the caller, collecting the definitions in
+  // DeferredCompiles.
+  Error compileDefinition(Symbol Name);
+  bool DeferCompiles = false;
+  std::vector<Symbol> DeferredCompiles;
+
+  // The name the current version of the definition Name has in the JIT.
+  std::string getImplName(Symbol Name) const;
+
+  // Add the module of the newest version of the definition Name and point
+  // its stub at it, dropping the previous version.
+  Error addDefinitionModule(Symbol Name, ThreadSafeModule TSM);
+
+  // After Name was redefined, drop what depended on its old version.
+  Error updateDependents(Symbol Name);
+
+  // Set Key to the key of E in ResultCache and return true, if E is a call
+  // of a pure definition whose arguments are all constant.
+  bool getResultKey(const ExprPool &Nodes, ExprId E,
+                    std::string &Key) const;
+
+  // Build and add the batch kernel KernelName for the definition Name.
+  Error addBatchKernel(Symbol Name, StringRef KernelName);
+
+  // With Opts.WholeFile, hand the module of the source that was just read
+  // over to the JIT, then build its batch kernels and run its top-level
+  // expressions.
+  Error finishWholeFile();
+
+  // Handle every top-level item of the source, from the first token on.
+  Error MainLoop();
+
+  // Parse Files in parallel, then handle their items as one program: see
+  // KaleidoscopeSession::runFiles().
+  Error runFiles(std::vector<SourceFile> Files, unsigned NumThreads);
+  unsigned NumFileErrors = 0; // Parse errors in runFiles().
+
+  // Report what the session holds on to, for ":mem".
+  void printMemoryUsage(raw_ostream &OS) const;
+
+  unsigned getNumErrors() const {
+    return P.NumErrors + CG.NumErrors + NumFileErrors;
+  }
+};
+
+void KaleidoscopeSession::Impl::InitializeModule() {
+  // Open a new context and module. A module that wasn't handed to the JIT
+  // has to go before the context it lives in.
+  CG.TheModule = nullptr;
+  CG.TheContext = std::make_unique<LLVMContext>();
+  CG.TheModule = std::make_unique<Module>("my cool jit", *CG.TheContext);
+
+  // Generate code for the JIT's target from the start, so the optimizer
+  // knows what it's tuning for. With no JIT, EmitFiles() takes care of it.
+  if (TheJIT) {
+    CG.TheModule->setDataLayout(TheJIT->getDataLayout());
+    CG.TheModule->setTargetTriple(TheJIT->getTargetTriple().str());
+  }
+  if (PGOSummary)
+    CG.TheModule->setProfileSummary(PGOSummary->getMD(*CG.TheContext),
+                                    ProfileSummary::PSK_Instr);
+
+  // Create a new builder for the module.
+  CG.Builder = std::make_unique<IRBuilder<>>(*CG.TheContext);
+  CG.Builder->setFastMathFlags(CG.FMF);
+
+  // Forget the declarations in the previous module.
+  for (Symbol S : CG.ModuleSymbols)
+    CG.ModuleFunctions[S] = nullptr;
+  CG.ModuleSymbols.clear();
+}
+
+Expected<JITTargetAddress>
+KaleidoscopeSession::Impl::resolveForInterpreter(Symbol Sym) {
+  if (Sym < CG.DefinedFunctions.size() && CG.DefinedFunctions[Sym])
+    ++NumTierUps;
+  auto Addr = TheJIT->lookup(Symbols.getName(Sym));
+  if (!Addr)
+    return Addr.takeError();
+  return Addr->getAddress();
+}
+
+Error KaleidoscopeSession::Impl::HandleDefinition() {
+  std::unique_ptr<FunctionAST> FnAST;
+  {
+    CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::Parse);
+    FnAST = P.ParseDefinition();
+  }
+  if (!FnAST) {
+    // Skip token for error recovery.
+    P.getNextToken();
+    return Error::success();
+  }
+  return addDefinition(std::move(FnAST));
+}
+
+Error KaleidoscopeSession::Impl::addDefinition(
+    std::unique_ptr<FunctionAST> FnAST) {
+  Symbol Name = FnAST->getSymbol();
+  Function *FnIR;
+  {
+    CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::IRGen);
+    FnIR = FnAST->codegen(CG);
+  }
+  if (!FnIR)
+    return Error::success();
+
+  ++NumDefinitions;
+  bool Redefined = Name < CG.DefinedFunctions.size() &&
+                   CG.DefinedFunctions[Name];
+  if (Name >= CG.DefinedFunctions.size())
+    CG.DefinedFunctions.resize(Name + 1);
+  CG.DefinedFunctions.set(Name);
+  if (!Opts.AheadOfTime && !Opts.WholeFile) {
+    // Other modules call the function through its stub.
+    ++symbolEntry(DefinitionVersions, Name);
+    FnIR->setName(getImplName(Name));
+  }
+  if (Opts.PrintIR) {
+    fprintf(stderr, "Read function definition:\n");
+    FnIR->print(errs());
+    fprintf(stderr, "\n");
+  }
+  if (Opts.AheadOfTime)
+    return Error::success(); // Everything stays in TheModule.
+  if (Opts.WholeFile) {
+    FileDefinitions.push_back(Name);
+    return Error::success();
+  }
+
+  // Hand the module over to the JIT and start a new one, later modules
+  // re-declare the function through FunctionProtos.
+  auto Bitcode = std::make_shared<SmallVector<char, 0>>();
+  raw_svector_ostream BitcodeOS(*Bitcode);
+  WriteBitcodeToFile(*CG.TheModule, BitcodeOS);
+  symbolEntry(DefinitionBitcode, Name) = std::move(Bitcode);
+  auto TSM = ThreadSafeModule(std::move(CG.TheModule),
+                              std::move(CG.TheContext));
+  InitializeModule();
+  if (auto Err = addDefinitionModule(Name, std::move(TSM)))
+    return Err;
+  if (Redefined)
+    if (auto Err = updateDependents(Name))
+      return Err;
+
+  if (Interp) {
+    // Calls are interpreted until the definition gets hot, the JIT only
+    // compiles it then (or when native code calls it). Memoized definitions
+    // are only worth running natively.
+    std::unique_ptr<Bytecode> BC;
+    if (!FnAST->isMemo()) {
+      CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::IRGen);
+      std::pair<size_t, unsigned> Counters;
+      if (Name < CG.FunctionCounters.size())
+        Counters = CG.FunctionCounters[Name];
+      BC = BytecodeCompiler::compile(CG, FnAST->getNodes(), FnAST->getBody(),
+                                     CG.FunctionProtos[Name]->getArgs().size(),
+                                     FnAST->getNumSlots(), Counters);
+    }
+    Interp->define(Name, std::move(BC));
+    return Error::success();
+  }
+  // By default the stub compiles the function on its first call. This is all
+  // there is to CompilerOptions::Lazy.
+  if (!Opts.JIT.NumCompileThreads && Opts.Lazy)
+    return Error::success();
+  if (DeferCompiles) {
+    DeferredCompiles.push_back(Name);
+    return Error::success();
+  }
+  return compileDefinition(Name);
+}
+
+Error KaleidoscopeSession::Impl::compileDefinition(Symbol Name) {
+  if (Opts.JIT.NumCompileThreads) {
+    // Keep going while the compile threads work on it.
+    TheJIT->compileInBackground(getImplName(Name));
+    return Error::success();
+  }
+  if (auto Sym = TheJIT->lookup(getImplName(Name)); !Sym)
+    return Sym.takeError();
+  return Error::success();
+}
+
+std::string KaleidoscopeSession::Impl::getImplName(Symbol Name) const {
+  unsigned Version = Name < DefinitionVersions.size()
+                         ? DefinitionVersions[Name] : 0;
+  if (!Version)
+    return Symbols.getName(Name).str();
+  return (Symbols.getName(Name) + "." + Twine(Version)).str();
+}
+
+Error KaleidoscopeSession::Impl::addDefinitionModule(Symbol Name,
+                                                     ThreadSafeModule TSM) {
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  if (auto Err = TheJIT->addModule(std::move(TSM), RT))
+    return Err;
+  if (auto Err = TheJIT->setStubTarget(Symbols.getName(Name),
+                                       getImplName(Name)))
+    return Err;
+  // Nothing reaches the previous version any more, but the compile threads
+  // may still be compiling it: its tracker goes once they are done.
+  ResourceTrackerSP Old = std::exchange(symbolEntry(DefinitionTrackers, Name),
+                                        std::move(RT));
+  if (!Old)
+    return Error::success();
+  TheJIT->waitForCompiles();
+  return Old->remove();
+}
+
+Error KaleidoscopeSession::Impl::updateDependents(Symbol Name) {
+  // Callers reach the new version through its stub and need no recompiling,
+  // but results computed with the old one go.
+  std::vector<Symbol> Dependents = CG.getDependents(Name);
+  BitVector Stale(Symbols.size());
+  Stale.set(Name);
+  for (Symbol D : Dependents)
+    Stale.set(D);
+  for (auto I = ResultCache.begin(), E = ResultCache.end(); I != E;) {
+    auto Cur = I++;
+    Symbol Callee;
+    memcpy(&Callee, Cur->getKey().data(), sizeof(Callee));
+    if (Stale[Callee])
+      ResultCache.erase(Cur);
+  }
+
+  // Memoized dependents are compiled again for an empty memo table.
+  for (Symbol D : Dependents) {
+    if (!CG.isMemo(D))
+      continue;
+    auto &Bitcode = *DefinitionBitcode[D];
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto MOrErr = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                        Symbols.getName(D)),
+        *Ctx);
+    if (!MOrErr)
+      return MOrErr.takeError();
+    std::unique_ptr<Module> M = std::move(*MOrErr);
+    Function *F = M->getFunction(getImplName(D));
+    ++DefinitionVersions[D];
+    F->setName(getImplName(D));
+    auto NewBitcode = std::make_shared<SmallVector<char, 0>>();
+    raw_svector_ostream BitcodeOS(*NewBitcode);
+    WriteBitcodeToFile(*M, BitcodeOS);
+    DefinitionBitcode[D] = std::move(NewBitcode);
+    if (auto Err = addDefinitionModule(
+            D, ThreadSafeModule(std::move(M), std::move(Ctx))))
+      return Err;
+  }
+
+  // Batch kernels have their definition inlined into them, memo table and
+  // all: Name's has the old definition, a memoized dependent's results that
+  // came from it.
+  Dependents.insert(Dependents.begin(), Name);
+  for (Symbol D : Dependents) {
+    if (D >= KernelTrackers.size() || !KernelTrackers[D])
+      continue;
+    TheJIT->waitForCompiles();
+    if (auto Err = std::exchange(KernelTrackers[D], nullptr)->remove())
+      return Err;
+    if (auto Err = addBatchKernel(D, (Symbols.getName(D) + "_batch").str()))
+      return Err;
+  }
+  return Error::success();
+}
+
+Error KaleidoscopeSession::Impl::HandleExtern() {
+  std::unique_ptr<PrototypeAST> ProtoAST;
+  {
+    CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::Parse);
+    ProtoAST = P.ParseExtern();
+  }
+  if (ProtoAST)
+    addExtern(std::move(ProtoAST));
+  else
+    // Skip token for error recovery.
+    P.getNextToken();
+  return Error::success();
+}
+
+void KaleidoscopeSession::Impl::addExtern(
+    std::unique_ptr<PrototypeAST> ProtoAST) {
+  if (auto *FnIR = ProtoAST->codegen(CG)) {
+    ++NumExterns;
+    if (Opts.PrintIR) {
+      fprintf(stderr, "Read extern: \n");
+      FnIR->print(errs());
+      fprintf(stderr, "\n");
+    }
+    symbolEntry(CG.FunctionProtos, ProtoAST->getSymbol()) =
+        std::move(ProtoAST);
+  }
+}
+
+// Add a batch kernel to F's module that maps F over arrays:
+//
+//   void f_batch(const double *a, const double *b, ..., double *out, size_t n)
+//
+// sets out[i] = f(a[i], b[i], ...) for every i < n. out must not overlap the
+// inputs, which lets the kernel be vectorized without runtime checks.
+static Function *CodegenBatchKernel(Function *F, StringRef Name) {
+    LLVMContext &Ctx = F->getContext();
+    Module &M = *F->getParent();
+    Type *DoubleTy = Type::getDoubleTy(Ctx);
+    Type *PtrTy = PointerType::getUnqual(DoubleTy);
+    Type *SizeTy = M.getDataLayout().getIntPtrType(Ctx);
+
+    std::vector<Type *> Params(F->arg_size() + 1, PtrTy);
+    Params.push_back(SizeTy);
+    Function *K = Function::Create(
+        FunctionType::get(Type::getVoidTy(Ctx), Params, false),
+        Function::ExternalLinkage, Name, M);
+    unsigned NumIn = F->arg_size();
+    for (unsigned i = 0; i != NumIn; ++i) {
+        K->getArg(i)->setName(F->getArg(i)->getName());
+        K->addParamAttr(i, Attribute::ReadOnly);
+        K->addParamAttr(i, Attribute::NoCapture);
+    }
+    Argument *Out = K->getArg(NumIn), *N = K->getArg(NumIn + 1);
+    Out->setName("out");
+    K->addParamAttr(NumIn, Attribute::NoAlias);
+    K->addParamAttr(NumIn, Attribute::NoCapture);
+    N->setName("n");
+
+    IRBuilder<> B(BasicBlock::Create(Ctx, "entry", K));
+    BasicBlock *LoopBB = BasicBlock::Create(Ctx, "loop", K);
+    BasicBlock *ExitBB = BasicBlock::Create(Ctx, "exit", K);
+    B.CreateCondBr(B.CreateICmpEQ(N, ConstantInt::get(SizeTy, 0), "empty"),
+                   ExitBB, LoopBB);
+
+    B.SetInsertPoint(LoopBB);
+    PHINode *I = B.CreatePHI(SizeTy, 2, "i");
+    I->addIncoming(ConstantInt::get(SizeTy, 0), &K->getEntryBlock());
+    SmallVector<Value *, 8> Args;
+    for (unsigned i = 0; i != NumIn; ++i)
+        Args.push_back(B.CreateLoad(DoubleTy,
+                B.CreateInBoundsGEP(DoubleTy, K->getArg(i), I)));
+    B.CreateStore(B.CreateCall(F, Args),
+            B.CreateInBoundsGEP(DoubleTy, Out, I));
+    Value *Next = B.CreateNUWAdd(I, ConstantInt::get(SizeTy, 1), "i.next");
+    I->addIncoming(Next, LoopBB);
+    B.CreateCondBr(B.CreateICmpEQ(Next, N, "done"), ExitBB, LoopBB);
+
+    B.SetInsertPoint(ExitBB);
+    B.CreateRetVoid();
+
+    verifyFunction(*K);
+    return K;
+}
+
+// Handle "vectorize f": compile a batch kernel f_batch for the definition f
+// (see CodegenBatchKernel()) that callers of the JIT can look up.
+Error KaleidoscopeSession::Impl::HandleVectorize() {
+  P.getNextToken(); // eat vectorize.
+  if (P.getCurTok().Kind != tok_identifier) {
+    P.LogError("expected function name after vectorize");
+    return Error::success();
+  }
+  Symbol Name = P.getCurTok().Sym;
+  P.getNextToken(); // eat the name.
+  return addVectorize(Name);
+}
+
+Error KaleidoscopeSession::Impl::addVectorize(Symbol Name) {
+  if (Name >= CG.DefinedFunctions.size() || !CG.DefinedFunctions[Name]) {
+    CG.LogErrorV("only defined functions can be vectorized");
+    return Error::success();
+  }
+  std::string KernelName = (Symbols.getName(Name) + "_batch").str();
+  Symbol KernelSym = Symbols.intern(KernelName);
+  if (KernelSym < CG.DefinedFunctions.size() &&
+      CG.DefinedFunctions[KernelSym]) {
+    CG.LogErrorV("function is already vectorized");
+    return Error::success();
+  }
+
+  if (KernelSym >= CG.DefinedFunctions.size())
+    CG.DefinedFunctions.resize(KernelSym + 1);
+  CG.DefinedFunctions.set(KernelSym);
+
+  // A definition still in the current module is compiled along with the rest
+  // of it, its kernel has to wait until then.
+  if (Opts.WholeFile && !Opts.AheadOfTime &&
+      (Name >= DefinitionBitcode.size() || !DefinitionBitcode[Name])) {
+    FileKernels.push_back(Name);
+    return Error::success();
+  }
+  return addBatchKernel(Name, KernelName);
+}
+
+Error KaleidoscopeSession::Impl::addBatchKernel(Symbol Name,
+                                                StringRef KernelName) {
+  Function *K;
+  std::unique_ptr<LLVMContext> Ctx;
+  std::unique_ptr<Module> M;
+  if (Opts.AheadOfTime) {
+    // The definition is right here in TheModule, the kernel is optimized
+    // along with it.
+    K = CodegenBatchKernel(CG.getFunction(Name), KernelName);
+  } else {
+    // Load a private copy of the definition to inline into the kernel,
+    // calls from it resolve to the JIT's functions as usual.
+    Ctx = std::make_unique<LLVMContext>();
+    auto &Bitcode = *DefinitionBitcode[Name];
+    auto MOrErr = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                        KernelName),
+        *Ctx);
+    if (!MOrErr)
+      return MOrErr.takeError();
+    M = std::move(*MOrErr);
+    Function *F = M->getFunction(getImplName(Name));
+    // The module may hold a whole file, the JIT already has the rest of it.
+    for (Function &Other : *M)
+      if (&Other != F)
+        Other.deleteBody();
+    F->setLinkage(Function::InternalLinkage);
+    F->addFnAttr(Attribute::AlwaysInline);
+    K = CodegenBatchKernel(F, KernelName);
+  }
+  ++NumBatchKernels;
+  if (Opts.PrintIR) {
+    fprintf(stderr, "Read batch kernel:\n");
+    K->print(errs());
+    fprintf(stderr, "\n");
+  }
+
+  if (!M)
+    return Error::success();
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  symbolEntry(KernelTrackers, Name) = RT;
+  return TheJIT->addKernelModule(
+      ThreadSafeModule(std::move(M), std::move(Ctx)), std::move(RT));
+}
+
+Error KaleidoscopeSession::Impl::HandleTopLevelExpression() {
+  // Evaluate a top-level expression into an anonymous function.
+  std::unique_ptr<FunctionAST> FnAST;
+  {
+    CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::Parse);
+    FnAST = P.ParseTopLevelExpr();
+  }
+  if (!FnAST) {
+    // Skip token for error recovery.
+    P.getNextToken();
+    return Error::success();
+  }
+  return runTopLevelExpr(std::move(FnAST));
+}
+
+Error KaleidoscopeSession::Impl::runTopLevelExpr(
+    std::unique_ptr<FunctionAST> FnAST) {
+  if (Opts.AheadOfTime) {
+    fprintf(stderr, "Warning: ignoring top-level expression, there is "
+                    "nothing to run it when emitting files\n");
+    return Error::success();
+  }
+
+  // Expressions of constants are folded, and pure definitions always give
+  // the same result for the same arguments: neither needs any code.
+  std::optional<double> Known = foldConstant(FnAST->getNodes(), FnAST->getBody());
+  std::string ResultKey;
+  if (Known) {
+    ++NumFoldedExprs;
+  } else if (getResultKey(FnAST->getNodes(), FnAST->getBody(), ResultKey)) {
+    auto I = ResultCache.find(ResultKey);
+    if (I != ResultCache.end()) {
+      ++NumCachedExprs;
+      Known = I->second;
+    }
+  }
+  if (Known) {
+    ++NumTopLevelExprs;
+    if (Opts.WholeFile)
+      FileExprs.push_back({"", "", *Known});
+    else
+      fprintf(stderr, "Evaluated to %f\n", *Known);
+    return Error::success();
+  }
+
+  if (Interp) {
+    std::unique_ptr<Bytecode> BC;
+    unsigned NumErrors = CG.NumErrors;
+    {
+      CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::IRGen);
+      BC = BytecodeCompiler::compile(CG, FnAST->getNodes(), FnAST->getBody(),
+                                     0, FnAST->getNumSlots());
+    }
+    if (CG.NumErrors != NumErrors)
+      return Error::success();
+    // Otherwise only a call with too many arguments for the interpreter
+    // keeps it from running the expression, the JIT does.
+    if (BC) {
+      ++NumTopLevelExprs;
+      ++NumInterpretedExprs;
+      Expected<double> Result = 0.0;
+      {
+        CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::Execute);
+        Result = Interp->run(*BC);
+      }
+      if (!Result)
+        return Result.takeError();
+      fprintf(stderr, "Evaluated to %f\n", *Result);
+      if (!ResultKey.empty())
+        cacheResult(ResultKey, *Result);
+      return Error::success();
+    }
+  }
+
+  Symbol Name = FnAST->getSymbol();
+  Function *FnIR;
+  {
+    CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::IRGen);
+    FnIR = FnAST->codegen(CG);
+  }
+  if (!FnIR)
+    return Error::success();
+
+  ++NumTopLevelExprs;
+  if (Opts.PrintIR) {
+    fprintf(stderr, "Read top-level expression: \n");
+    FnIR->print(errs());
+    fprintf(stderr, "\n");
+  }
+
+  if (Opts.WholeFile) {
+    // Give the function a name of its own so the next expression can have
+    // one too, it's run in finishWholeFile().
+    FnIR->setName("__anon_expr." + Twine(FileExprs.size()));
+    FileExprs.push_back({FnIR->getName().str(), std::move(ResultKey), 0.0});
+    CG.ModuleFunctions[Name] = nullptr;
+    return Error::success();
+  }
+
+  // Create a resource tracker to track the JIT'd memory allocated to our
+  // anonymous expression, that way we can free it after executing.
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  auto TSM = ThreadSafeModule(std::move(CG.TheModule),
+                              std::move(CG.TheContext));
+  InitializeModule();
+  if (auto Err = TheJIT->addModule(std::move(TSM), RT))
+    return Err;
+
+  // Search the JIT for the __anon_expr symbol and cast it to the right type
+  // (takes no arguments, returns a double) so we can call it as a native
+  // function.
+  auto ExprSymbol = TheJIT->lookup("__anon_expr");
+  if (!ExprSymbol) {
+    TheJIT->waitForCompiles();
+    return joinErrors(ExprSymbol.takeError(), RT->remove());
+  }
+  double (*FP)() = (double (*)())(intptr_t)ExprSymbol->getAddress();
+  double Result;
+  {
+    CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::Execute);
+    Result = FP();
+  }
+  fprintf(stderr, "Evaluated to %f\n", Result);
+  if (!ResultKey.empty())
+    cacheResult(ResultKey, Result);
+
+  // Delete the anonymous expression module from the JIT, once whatever
+  // compiled it is done with it.
+  TheJIT->waitForCompiles();
+  return RT->remove();
+}
+
+bool KaleidoscopeSession::Impl::getResultKey(const ExprPool &Nodes, ExprId E,
+                                             std::string &Key) const {
+  if (Nodes.getKind(E) != ExprPool::EK_Call)
+    return false;
+  Symbol Callee = Nodes.getCallee(E);
+  if (!CG.isPure(Callee) || Callee >= CG.DefinedFunctions.size() ||
+      !CG.DefinedFunctions[Callee])
+    return false;
+
+  // The callee's symbol followed by the bits of each argument.
+  Key.assign(reinterpret_cast<const char *>(&Callee), sizeof(Callee));
+  for (ExprId Arg : Nodes.getArgs(E)) {
+    std::optional<double> Val = foldConstant(Nodes, Arg);
+    if (!Val)
+      return false;
+    uint64_t Bits = DoubleToBits(*Val);
+    Key.append(reinterpret_cast<const char *>(&Bits), sizeof(Bits));
+  }
+  return true;
+}
+
+Error KaleidoscopeSession::Impl::finishWholeFile() {
+  if (!Opts.WholeFile || Opts.AheadOfTime ||
+      (FileDefinitions.empty() && FileExprs.empty()))
+    return Error::success();
+
+  // Optimizing the module inlines definitions into each other, batch kernels
+  // need them as they were.
+  auto Bitcode = std::make_shared<SmallVector<char, 0>>();
+  raw_svector_ostream BitcodeOS(*Bitcode);
+  WriteBitcodeToFile(*CG.TheModule, BitcodeOS);
+  for (Symbol Name : FileDefinitions)
+    symbolEntry(DefinitionBitcode, Name) = Bitcode;
+  FileDefinitions.clear();
+
+  // The module is optimized as a whole the first time anything in it is
+  // looked up.
+  auto TSM = ThreadSafeModule(std::move(CG.TheModule),
+                              std::move(CG.TheContext));
+  InitializeModule();
+  if (auto Err = TheJIT->addModule(std::move(TSM)))
+    return Err;
+
+  for (Symbol Name : FileKernels)
+    if (auto Err = addBatchKernel(
+            Name, (Symbols.getName(Name) + "_batch").str()))
+      return Err;
+  FileKernels.clear();
+
+  auto Exprs = std::move(FileExprs);
+  FileExprs.clear();
+  for (FileExpr &E : Exprs) {
+    if (!E.FnName.empty()) {
+      auto ExprSymbol = TheJIT->lookup(E.FnName);
+      if (!ExprSymbol)
+        return ExprSymbol.takeError();
+      double (*FP)() = (double (*)())(intptr_t)ExprSymbol->getAddress();
+      {
+        CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::Execute);
+        E.Result = FP();
+      }
+      if (!E.ResultKey.empty())
+        cacheResult(E.ResultKey, E.Result);
+    }
+    fprintf(stderr, "Evaluated to %f\n", E.Result);
+  }
+  return Error::success();
+}
+
+
+// Handle a REPL command, ":mem" being the only one.
+Error KaleidoscopeSession::Impl::HandleCommand() {
+  P.getNextToken(); // eat ':'.
+  if (P.getCurTok().Kind != tok_identifier ||
+      Symbols.getName(P.getCurTok().Sym) != "mem") {
+    P.LogError("unknown command, expected :mem");
+    // Skip token for error recovery.
+    P.getNextToken();
+    return Error::success();
+  }
+  // Report before looking at the next token, which waits for more input.
+  printMemoryUsage(errs());
+  P.getNextToken(); // eat mem.
+  return Error::success();
+}
+
+void KaleidoscopeSession::Impl::printMemoryUsage(raw_ostream &OS) const {
+  size_t BitcodeBytes = 0;
+  for (const auto &Bitcode : DefinitionBitcode)
+    if (Bitcode)
+      BitcodeBytes += Bitcode->size();
+  size_t NumFunctions = 0, NumInstructions = 0;
+  if (CG.TheModule)
+    for (const Function &F : *CG.TheModule) {
+      ++NumFunctions;
+      NumInstructions += F.getInstructionCount();
+    }
+
+  OS << "symbols:           " << Symbols.size() << " ("
+     << Symbols.getMemorySize() << " bytes)\n"
+     << "expression nodes:  " << P.getASTMemorySize() << " bytes\n"
+     << "current module:    " << NumFunctions << " functions, "
+     << NumInstructions << " instructions\n"
+     << "kept bitcode:      " << BitcodeBytes << " bytes\n"
+     << "cached results:    " << ResultCache.size() << " of "
+     << MaxCachedResults << "\n";
+  if (TheJIT)
+    OS << "JIT code and data: " << TheJIT->getCodeMemory() << " bytes (peak "
+       << TheJIT->getPeakCodeMemory() << ")\n";
+  OS << "heap in use:       " << sys::Process::GetMallocUsage() << " bytes\n";
+}
+
+/// Main loop consumes tokens and calls the respective handler for each
+/// token.
+Error KaleidoscopeSession::Impl::MainLoop() {
+  if (Lex.isInteractive())
+    fprintf(stderr, "ready> ");
+  P.getNextToken();
+  while (true) {
+    if (Lex.isInteractive())
+      fprintf(stderr, "ready> ");
+    Error Err = Error::success();
+    switch (P.getCurTok().Kind) {
+    case tok_eof:
+      P.flushCounts();
+      return finishWholeFile();
+    case ';': // ignore top-level semicolons.
+      P.getNextToken();
+      break;
+    case tok_def:
+    case tok_memo:
+      Err = HandleDefinition();
+      break;
+    case tok_extern:
+      Err = HandleExtern();
+      break;
+    case tok_vectorize:
+      Err = HandleVectorize();
+      break;
+    case ':':
+      Err = HandleCommand();
+      break;
+    default:
+      Err = HandleTopLevelExpression();
+      break;
+    }
+    // Release the AST of the item we just handled.
+    P.ResetAST();
+    if (Err)
+      return Err;
+  }
+}
+
+namespace {
+// ParsedFile - One of the sources given to runFiles(), with its own lexer and
+// parser so it can be parsed on a thread of its own. The AST of everything it
+// holds stays in the parser's arena until it has been compiled.
+struct ParsedFile {
+  struct Item {
+    int Kind; // tok_def, tok_extern, tok_vectorize or 0 for an expression.
+    std::unique_ptr<FunctionAST> Fn; // Definition or top-level expression.
+    std::unique_ptr<PrototypeAST> Proto; // Extern.
+    Symbol Target; // Of vectorize.
+  };
+
+  Lexer Lex;
+  Parser P;
+  std::vector<Item> Items;
+  std::string Errors;
+
+  ParsedFile(SymbolTable &Symbols, SourceFile File)
+      : Lex(Symbols, /*Shared=*/true), P(Lex, Symbols) {
+    Lex.setSource(std::move(File.Source), /*Interactive=*/false);
+    P.FileName = std::move(File.Name);
+    P.ErrorLog = &Errors;
+  }
+
+  // Parse every item like MainLoop() does, without handling any.
+  void parse() {
+    P.getNextToken();
+    while (true) {
+      switch (P.getCurTok().Kind) {
+      case tok_eof:
+        P.flushCounts();
+        return;
+      case ';':
+        P.getNextToken();
+        continue;
+      case tok_def:
+      case tok_memo:
+        if (auto Fn = P.ParseDefinition()) {
+          Items.push_back({tok_def, std::move(Fn), nullptr, 0});
+          continue;
+        }
+        break;
+      case tok_extern:
+        if (auto Proto = P.ParseExtern()) {
+          Items.push_back({tok_extern, nullptr, std::move(Proto), 0});
+          continue;
+        }
+        break;
+      case tok_vectorize:
+        if (P.getNextToken() != tok_identifier) {
+          P.LogError("expected function name after vectorize");
+          continue;
+        }
+        Items.push_back({tok_vectorize, nullptr, nullptr,
+                         P.getCurTok().Sym});
+        P.getNextToken();
+        continue;
+      default:
+        if (auto Fn = P.ParseTopLevelExpr()) {
+          Items.push_back({0, std::move(Fn), nullptr, 0});
+          continue;
+        }
+        break;
+      }
+      // Skip token for error recovery.
+      P.getNextToken();
+    }
+  }
+};
+} // end anonymous namespace
+
+Error KaleidoscopeSession::Impl::runFiles(std::vector<SourceFile> Files,
+                                          unsigned NumThreads) {
+  std::vector<std::unique_ptr<ParsedFile>> Parsed;
+  for (SourceFile &File : Files)
+    Parsed.push_back(std::make_unique<ParsedFile>(Symbols, std::move(File)));
+  {
+    // The lexers only share the symbol table, which is locked for new names.
+    CompileStats::PhaseTimer T(Opts.JIT.Stats, CompileStats::Parse);
+    ThreadPool Pool(hardware_concurrency(NumThreads));
+    for (auto &F : Parsed)
+      Pool.async([&F] { F->parse(); });
+    Pool.wait();
+  }
+  for (auto &F : Parsed) {
+    fputs(F->Errors.c_str(), stderr);
+    NumFileErrors += F->P.NumErrors;
+  }
+
+  // Every file can call what any of them defines: declare all definitions
+  // up front, externs of them only have to agree.
+  BitVector DefinedInFiles(Symbols.size());
+  for (auto &F : Parsed)
+    for (auto &Item : F->Items) {
+      if (Item.Kind != tok_def)
+        continue;
+      Symbol Name = Item.Fn->getSymbol();
+      DefinedInFiles.set(Name);
+      auto &Proto = symbolEntry(CG.FunctionProtos, Name);
+      if (!Proto)
+        Proto = std::make_unique<PrototypeAST>(
+            Name, std::vector<Symbol>(Item.Fn->getArgs().begin(),
+                                      Item.Fn->getArgs().end()));
+    }
+
+  // Then handle the definitions, externs and kernels of every file in order,
+  // and only once they are all there run the top-level expressions. Nothing
+  // is compiled before everything it may call has been defined.
+  DeferCompiles = true;
+  CG.PendingDefinitions = std::move(DefinedInFiles);
+  auto Undefer = make_scope_exit([&] {
+    DeferCompiles = false;
+    CG.PendingDefinitions.clear();
+  });
+  for (auto &F : Parsed)
+    for (auto &Item : F->Items) {
+      Error Err = Error::success();
+      switch (Item.Kind) {
+      case tok_def:
+        Err = addDefinition(std::move(Item.Fn));
+        break;
+      case tok_extern: {
+        Symbol Name = Item.Proto->getSymbol();
+        if (Name >= CG.PendingDefinitions.size() ||
+            !CG.PendingDefinitions[Name])
+          addExtern(std::move(Item.Proto));
+        else if (CG.FunctionProtos[Name]->getArgs().size() !=
+                 Item.Proto->getArgs().size())
+          CG.LogErrorV("extern doesn't match the number of arguments of the "
+                       "definition");
+        break;
+      }
+      case tok_vectorize:
+        Err = addVectorize(Item.Target);
+        break;
+      }
+      if (Err)
+        return Err;
+    }
+  DeferCompiles = false;
+  CG.PendingDefinitions.clear();
+  for (Symbol Name : std::exchange(DeferredCompiles, {}))
+    if (auto Err = compileDefinition(Name))
+      return Err;
+
+  for (auto &F : Parsed)
+    for (auto &Item : F->Items)
+      if (Item.Kind == 0)
+        if (auto Err = runTopLevelExpr(std::move(Item.Fn)))
+          return Err;
+  return finishWholeFile();
+}
+
+Expected<std::unique_ptr<KaleidoscopeSession>>
+KaleidoscopeSession::Create(const CompilerOptions &Options) {
+  static std::once_flag InitTarget;
+  std::call_once(InitTarget, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+  });
+
+  if (Options.ProfileGenerate && Options.AheadOfTime)
+    return createStringError(inconvertibleErrorCode(),
+                             "profiles can only be generated by running the "
+                             "code in the JIT");
+  auto I = std::make_unique<Impl>(Options);
+  if (!Options.ProfileUse.empty()) {
+    auto PGO = Profile::read(Options.ProfileUse);
+    if (!PGO)
+      return PGO.takeError();
+    I->PGO = std::move(*PGO);
+    I->PGOSummary = I->PGO.getSummary();
+    I->CG.PGO = &I->PGO;
+  }
+  if (!Options.AheadOfTime) {
+    auto JIT = KaleidoscopeJIT::Create(Options.JIT);
+    if (!JIT)
+      return JIT.takeError();
+    I->TheJIT = std::move(*JIT);
+    if (Options.Tiered && !Options.WholeFile) {
+      Impl *Session = I.get();
+      I->Interp = std::make_unique<Interpreter>(
+          Options.TierUpThreshold,
+          [Session](uint32_t Sym) {
+            return Session->resolveForInterpreter(Sym);
+          });
+    }
+  }
+  I->InitializeModule();
+  return std::unique_ptr<KaleidoscopeSession>(
+      new KaleidoscopeSession(std::move(I)));
+}
+
+KaleidoscopeSession::KaleidoscopeSession(std::unique_ptr<Impl> I)
+    : I(std::move(I)) {}
+
+KaleidoscopeSession::~KaleidoscopeSession() = default;
+
+Error KaleidoscopeSession::compile(std::string_view Source) {
+  // The lexer relies on a '\0' after the end of the source.
+  I->CompileSource.assign(Source.data(), Source.size());
+  I->Lex.setSource(std::make_unique<StringSourceBuffer>(I->CompileSource),
+                   /*Interactive=*/false);
+  unsigned NumErrors = I->getNumErrors();
+  if (auto Err = I->MainLoop())
+    return Err;
+  if (unsigned N = I->getNumErrors() - NumErrors)
+    return createStringError(inconvertibleErrorCode(),
+                             "%u error(s) in the source", N);
+  return Error::success();
+}
+
+Error KaleidoscopeSession::run(std::unique_ptr<SourceBuffer> Source,
+                               bool Interactive) {
+  I->Lex.setSource(std::move(Source), Interactive);
+  return I->MainLoop();
+}
+
+Expected<JITTargetAddress> KaleidoscopeSession::lookupAddress(StringRef Name) {
+  if (!I->TheJIT)
+    return createStringError(inconvertibleErrorCode(),
+                             "nothing to look '%s' up in when compiling "
+                             "ahead of time", Name.str().c_str());
+  auto Sym = I->TheJIT->lookup(Name);
+  if (!Sym)
+    return Sym.takeError();
+  return Sym->getAddress();
+}
+
+Error KaleidoscopeSession::runFiles(std::vector<SourceFile> Files,
+                                    unsigned NumThreads) {
+  return I->runFiles(std::move(Files), NumThreads);
+}
+
+Error KaleidoscopeSession::writeProfile(StringRef Path) const {
+  const CodeGen &CG = I->CG;
+  if (!CG.Instrument)
+    return createStringError(inconvertibleErrorCode(),
+                             "nothing was compiled to generate a profile");
+  Profile P;
+  for (Symbol S = 0; S != CG.FunctionCounters.size(); ++S) {
+    auto [At, N] = CG.FunctionCounters[S];
+    if (!N)
+      continue;
+    std::vector<uint64_t> Row(CG.Counters.begin() + At,
+                              CG.Counters.begin() + At + N);
+    P.set(CG.Symbols.getName(S), std::move(Row));
+  }
+  return P.write(Path);
+}
+
+void KaleidoscopeSession::setSource(std::unique_ptr<SourceBuffer> Source,
+                                    bool Interactive) {
+  I->Lex.setSource(std::move(Source), Interactive);
+}
+
+int KaleidoscopeSession::getNextToken() { return I->P.getNextToken(); }
+
+const Token &KaleidoscopeSession::getCurTok() const {
+  return I->P.getCurTok();
+}
+
+std::unique_ptr<FunctionAST> KaleidoscopeSession::ParseDefinition() {
+  return I->P.ParseDefinition();
+}
+
+std::unique_ptr<PrototypeAST> KaleidoscopeSession::ParseExtern() {
+  return I->P.ParseExtern();
+}
+
+std::unique_ptr<FunctionAST> KaleidoscopeSession::ParseTopLevelExpr() {
+  return I->P.ParseTopLevelExpr();
+}
+
+void KaleidoscopeSession::ResetAST() { I->P.ResetAST(); }
+
+Function *KaleidoscopeSession::codegen(FunctionAST &F) {
+  return F.codegen(I->CG);
+}
+
+void KaleidoscopeSession::InitializeModule() { I->InitializeModule(); }
+
+Module &KaleidoscopeSession::getModule() { return *I->CG.TheModule; }
+
+KaleidoscopeJIT *KaleidoscopeSession::getJIT() { return I->TheJIT.get(); }
+
+void KaleidoscopeSession::printMemoryUsage(raw_ostream &OS) const {
+  I->printMemoryUsage(OS);
+}
+
+void KaleidoscopeSession::printStats(raw_ostream &OS) const {
+  if (I->TheJIT)
+    MaxJITCodeBytes.updateMax(I->TheJIT->getPeakCodeMemory());
+  std::pair<StringRef, uint64_t> Rates[] = {
+      {"tokens", NumTokens}, {"ast_nodes", NumASTNodes}};
+  I->Opts.JIT.Stats->print(OS, Rates);
+}
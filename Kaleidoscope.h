@@ -0,0 +1,247 @@
+#ifndef KALEIDOSCOPE_H
+#define KALEIDOSCOPE_H
+
+// The Kaleidoscope compiler as a library: a KaleidoscopeSession holds a lexer,
+// parser, code generator and JIT of its own, so programs can embed any number
+// of them. The kaleidoscope driver (main.cpp) runs one session over its input,
+// and the benchmarks drive each phase of a session on its own.
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "KaleidoscopeJIT.h"
+#include "SourceBuffer.h"
+
+// The lexer returns tokens defined below.
+enum TokenKind {
+  tok_eof = - 1,
+  tok_def = -2,
+  tok_extern = -3,
+  tok_identifier = -4,
+  tok_number = -5,
+
+  // control
+  tok_if = -6,
+  tok_then = -7,
+  tok_else = -8,
+  tok_for = -9,
+  tok_in = -10,
+
+  // var definition
+  tok_var = -11,
+
+  // batch kernels
+  tok_vectorize = -12,
+
+  // definition attributes
+  tok_memo = -13,
+};
+
+// Symbol - Dense id of an interned identifier.
+using Symbol = uint32_t;
+
+// SourceLocation - Position of a token in the input, both 1 based.
+struct SourceLocation {
+    unsigned Line;
+    unsigned Col;
+};
+
+// Token - A lexed token, Text points into the source buffer and stays valid
+// until the next token is lexed.
+struct Token {
+    int Kind; // One of TokenKind or a plain character.
+    std::string_view Text;
+    double NumVal; // Filled in if tok_number
+    Symbol Sym; // Filled in if tok_identifier
+    SourceLocation Loc;
+};
+
+class ExprPool;
+class CodeGen;
+
+// ExprId - Index of an expression node in its ExprPool.
+using ExprId = uint32_t;
+constexpr ExprId NoExpr = ~ExprId(0); // No node, or a parse error.
+
+// PrototypeAST - This class represents the "prototype" for a function,
+// which captures its name and argument names.
+class PrototypeAST {
+    Symbol Name;
+    std::vector<Symbol> Args;
+
+    public:
+    PrototypeAST(Symbol Name, std::vector<Symbol> Args)
+        : Name(Name), Args(std::move(Args)) {}
+    llvm::Function *codegen(CodeGen &CG);
+    Symbol getSymbol() const { return Name; }
+    llvm::ArrayRef<Symbol> getArgs() const { return Args; }
+};
+
+// FunctionAST - This class represents a function definition.
+class FunctionAST {
+    std::unique_ptr<PrototypeAST> Proto;
+    const ExprPool *Nodes; // The parser's, which Body is in.
+    ExprId Body;
+    unsigned NumSlots; // Number of variables, arguments come first.
+    bool Memo; // Defined with "memo def", see CodeGen::emitMemoLookup().
+
+    public:
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, const ExprPool &Nodes,
+            ExprId Body, unsigned NumSlots, bool Memo = false)
+        : Proto(std::move(Proto)), Nodes(&Nodes), Body(Body),
+          NumSlots(NumSlots), Memo(Memo) {}
+    llvm::Function *codegen(CodeGen &CG);
+    // Only valid before codegen(), which hands the prototype over to
+    // CG.FunctionProtos.
+    Symbol getSymbol() const { return Proto->getSymbol(); }
+    llvm::ArrayRef<Symbol> getArgs() const { return Proto->getArgs(); }
+    const ExprPool &getNodes() const { return *Nodes; }
+    ExprId getBody() const { return Body; }
+    unsigned getNumSlots() const { return NumSlots; }
+    bool isMemo() const { return Memo; }
+};
+
+// SourceFile - A named source, for KaleidoscopeSession::runFiles().
+struct SourceFile {
+    std::string Name; // Put in front of the errors found in it.
+    std::unique_ptr<SourceBuffer> Source;
+};
+
+// CompilerOptions - How the compiler handles what it reads.
+struct CompilerOptions {
+    llvm::orc::JITOptions JIT;
+    // Compile definitions on their first call through their stub rather
+    // than as soon as they are read. Ignored with compile threads, which
+    // compile every definition in the background, and with tiered
+    // compilation, which leaves it to the interpreter.
+    bool Lazy = true;
+    // Keep everything in the current module, to be written out once the
+    // whole source has been read, instead of handing it to a JIT.
+    bool AheadOfTime = false;
+    // Keep every definition of a source in one module, which is optimized
+    // as a whole (see JITOptions::Interprocedural) once the source has been
+    // read. Top-level expressions are run then, in order.
+    bool WholeFile = false;
+    // Run new code in the Interpreter first, definitions are only compiled
+    // by the JIT once they have been called (or looped) TierUpThreshold
+    // times. Ignored with AheadOfTime or WholeFile.
+    bool Tiered = false;
+    unsigned TierUpThreshold = 1000;
+    // Fast-math flags put on every floating point operation.
+    llvm::FastMathFlags FMF;
+    // Count how often each definition is called and which way its ifs and
+    // loops go, for writeProfile(). Needs the JIT to run the code.
+    bool ProfileGenerate = false;
+    // Optimize with the counts in this profile file, written by an earlier
+    // session with ProfileGenerate: the optimizer inlines, lays out blocks
+    // and unrolls for the paths that were hot.
+    std::string ProfileUse;
+    // Print the IR of everything read to stderr.
+    bool PrintIR = true;
+};
+
+// KaleidoscopeSession - A compiler and its JIT. Sessions share nothing but
+// LLVM's statistics, so independent sessions can be used on different threads
+// at the same time, though each one only on one thread at a time.
+class KaleidoscopeSession {
+    public:
+    class Impl;
+
+    // Create a session with a JIT (unless compiling ahead of time) and an
+    // empty module, initializing the native target on first use.
+    static llvm::Expected<std::unique_ptr<KaleidoscopeSession>>
+    Create(const CompilerOptions &Options = CompilerOptions());
+    ~KaleidoscopeSession();
+
+    // Compile and run every top-level item of Source, definitions stay
+    // around for later calls and lookup(). Items with errors are reported on
+    // stderr and skipped, and then fail compile() once the rest has been
+    // handled.
+    llvm::Error compile(std::string_view Source);
+
+    // Compile and run every top-level item of Source, which gets a prompt
+    // before each one if Interactive. Errors in the source are reported and
+    // skipped, only errors from the JIT fail the run.
+    llvm::Error run(std::unique_ptr<SourceBuffer> Source, bool Interactive);
+
+    // Compile and run several files as one program. The files are parsed in
+    // parallel, on up to NumThreads threads (0 for one per core). Then the
+    // definitions, externs and batch kernels of all of them are compiled, in
+    // order, and only then the top-level expressions are run, so any file
+    // can call what another one defines. Errors are handled as in run().
+    llvm::Error runFiles(std::vector<SourceFile> Files,
+                         unsigned NumThreads = 0);
+
+    // Get a pointer to the compiled function or batch kernel Name, compiling
+    // it now if it was left to be compiled lazily. FnT is its type, e.g.
+    // lookup<double(double)>("f").
+    template <typename FnT = void>
+    llvm::Expected<FnT *> lookup(llvm::StringRef Name) {
+        auto Addr = lookupAddress(Name);
+        if (!Addr)
+            return Addr.takeError();
+        return reinterpret_cast<FnT *>(static_cast<uintptr_t>(*Addr));
+    }
+    llvm::Expected<llvm::JITTargetAddress> lookupAddress(llvm::StringRef Name);
+
+    // Write what the definitions compiled with Options.ProfileGenerate did so
+    // far to the profile file Path, for Options.ProfileUse. With the
+    // interpreter, what it ran is counted along with the native code: the
+    // calls, ifs and loops of a definition all count both tiers.
+    llvm::Error writeProfile(llvm::StringRef Path) const;
+
+    // The phases on their own, for the benchmarks.
+
+    // Lex from Source from now on.
+    void setSource(std::unique_ptr<SourceBuffer> Source, bool Interactive);
+
+    // Lex the next token, the one the parser looks at, and return its kind.
+    int getNextToken();
+    const Token &getCurTok() const;
+
+    // Parse a top-level item starting at the current token. The nodes of the
+    // expressions are kept by the parser until ResetAST().
+    std::unique_ptr<FunctionAST> ParseDefinition();
+    std::unique_ptr<PrototypeAST> ParseExtern();
+    std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+    void ResetAST();
+
+    // Generate IR for F into the current module.
+    llvm::Function *codegen(FunctionAST &F);
+
+    // Start a new module for code generation, the current module until the
+    // next call.
+    void InitializeModule();
+    llvm::Module &getModule();
+
+    // Null when compiling ahead of time.
+    llvm::orc::KaleidoscopeJIT *getJIT();
+
+    // Report the memory the session holds: its symbols and AST, the IR and
+    // bitcode it keeps, its result cache and the JIT's code, as the REPL's
+    // ":mem" command does.
+    void printMemoryUsage(llvm::raw_ostream &OS) const;
+
+    // Write the --stats report, Options.JIT.Stats must have been set.
+    void printStats(llvm::raw_ostream &OS) const;
+
+    private:
+    explicit KaleidoscopeSession(std::unique_ptr<Impl> I);
+
+    std::unique_ptr<Impl> I;
+};
+
+#endif // KALEIDOSCOPE_H
@@ -0,0 +1,515 @@
+#ifndef KALEIDOSCOPE_JIT_H
+#define KALEIDOSCOPE_JIT_H
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CompileStats.h"
+#include "KaleidoscopeObjectCache.h"
+#include "Optimizer.h"
+
+namespace llvm {
+namespace orc {
+
+// JITOptions - How a KaleidoscopeJIT optimizes and compiles code.
+struct JITOptions {
+    OptimizationLevel Level = OptimizationLevel::O1;
+    // Run optimization and code generation on a pool of this many threads
+    // rather than on the thread doing the lookup.
+    unsigned NumCompileThreads = 0;
+    // Directory to keep compiled objects in across runs, none if empty.
+    std::string CacheDir;
+    // CPU to generate code for, the host's if empty.
+    std::string CPU;
+    // Let the code generator fuse floating point multiplies and adds (into
+    // FMAs) even where the IR doesn't say it may.
+    bool FuseFPOps = false;
+    // Optimize each module as a whole program, across its functions (see
+    // Optimizer).
+    bool Interprocedural = false;
+    // SIMD math library the vectorizers may call, loaded into the process
+    // by the JIT (see getVectorLibraryFile()).
+    TargetLibraryInfoImpl::VectorLibrary VecLib =
+        TargetLibraryInfoImpl::NoLibrary;
+    // Tell profilers and debuggers where JITed functions are: perf through a
+    // perf map (see PerfMapListener) and a jitdump for "perf inject --jit",
+    // gdb through its JIT interface, and VTune where LLVM supports it.
+    bool PerfMap = false;
+    // Where to record optimization and code generation times, if anywhere.
+    // Must outlive the JIT.
+    CompileStats *Stats = nullptr;
+};
+
+// TimedIRCompiler - Adds the time another IR compiler takes to the code
+// generation phase of a CompileStats.
+class TimedIRCompiler : public IRCompileLayer::IRCompiler {
+    std::unique_ptr<IRCompiler> C;
+    CompileStats &Stats;
+
+    public:
+    TimedIRCompiler(std::unique_ptr<IRCompiler> C, CompileStats &Stats)
+        : IRCompiler(C->getManglingOptions()), C(std::move(C)), Stats(Stats) {}
+
+    Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+        CompileStats::PhaseTimer T(&Stats, CompileStats::CodeGen);
+        return (*C)(M);
+    }
+};
+
+// CountingMemoryMapper - Maps the pages the JIT's memory managers put code
+// and data in, keeping count of how much is mapped. Each object gets a
+// memory manager of its own, which unmaps its pages when the object's
+// resource tracker is removed, so this is the memory of the code that is
+// still around.
+class CountingMemoryMapper : public SectionMemoryManager::MemoryMapper {
+    std::atomic<size_t> Mapped{0};
+    std::atomic<size_t> PeakMapped{0};
+
+    public:
+    sys::MemoryBlock
+    allocateMappedMemory(SectionMemoryManager::AllocationPurpose,
+                         size_t NumBytes, const sys::MemoryBlock *NearBlock,
+                         unsigned Flags, std::error_code &EC) override {
+        sys::MemoryBlock MB =
+            sys::Memory::allocateMappedMemory(NumBytes, NearBlock, Flags, EC);
+        if (EC)
+            return MB;
+        size_t Now = Mapped += MB.allocatedSize();
+        size_t Peak = PeakMapped;
+        while (Now > Peak && !PeakMapped.compare_exchange_weak(Peak, Now))
+            ;
+        return MB;
+    }
+
+    std::error_code protectMappedMemory(const sys::MemoryBlock &Block,
+                                        unsigned Flags) override {
+        return sys::Memory::protectMappedMemory(Block, Flags);
+    }
+
+    std::error_code releaseMappedMemory(sys::MemoryBlock &M) override {
+        Mapped -= M.allocatedSize();
+        return sys::Memory::releaseMappedMemory(M);
+    }
+
+    size_t getMappedBytes() const { return Mapped; }
+    size_t getPeakMappedBytes() const { return PeakMapped; }
+};
+
+// PerfMapListener - Writes the address, size and name of every JITed
+// function to /tmp/perf-<pid>.map, where perf looks for symbols of code that
+// isn't in any file. Nothing is ever taken out: perf maps have no way to say
+// that code went away, so a reused address may show up under an old name.
+class PerfMapListener : public JITEventListener {
+    std::mutex Lock;
+    std::unique_ptr<raw_fd_ostream> Map;
+
+    public:
+    void notifyObjectLoaded(ObjectKey, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override {
+        // The object as it was loaded, with its symbols at their addresses.
+        object::OwningBinary<object::ObjectFile> Loaded =
+            L.getObjectForDebug(Obj);
+        if (!Loaded.getBinary())
+            return;
+        std::lock_guard<std::mutex> Guard(Lock);
+        if (!Map) {
+            std::string Path =
+                ("/tmp/perf-" + Twine(sys::Process::getProcessId()) + ".map")
+                    .str();
+            std::error_code EC;
+            Map = std::make_unique<raw_fd_ostream>(Path, EC,
+                                                   sys::fs::OF_Text);
+            if (EC) {
+                fprintf(stderr, "Warning: could not open '%s': %s\n",
+                        Path.c_str(), EC.message().c_str());
+                return;
+            }
+        }
+        for (auto &[Sym, Size] :
+             object::computeSymbolSizes(*Loaded.getBinary())) {
+            auto Type = Sym.getType();
+            auto Name = Sym.getName();
+            auto Addr = Sym.getAddress();
+            if (!Type || !Name || !Addr) {
+                consumeError(Type.takeError());
+                consumeError(Name.takeError());
+                consumeError(Addr.takeError());
+                continue;
+            }
+            if (*Type != object::SymbolRef::ST_Function || !Size)
+                continue;
+            *Map << format("%llx %llx ", (unsigned long long)*Addr,
+                           (unsigned long long)Size)
+                 << *Name << '\n';
+        }
+        // Perf may read it while the process is still running.
+        Map->flush();
+    }
+};
+
+// KaleidoscopeJIT - Thin wrapper over ORC's LLJIT. Modules added with
+// addModule() are optimized and compiled to native code the first time one
+// of their symbols is looked up. Symbols that aren't defined by a module
+// (e.g. "extern sin(x)") are resolved against the host process.
+//
+// A function can also be given a stub with setStubTarget(): the stub is what
+// its name resolves to, and it jumps to whichever implementation it was last
+// pointed at, compiling it on the first call. Code calling the function by
+// name keeps working, unchanged, when the stub is pointed somewhere else.
+class KaleidoscopeJIT {
+    // Used by J, so must outlive it.
+    std::unique_ptr<OptimizerPool> Opt;
+    // Batch kernels are always optimized at -O3, which runs the loop and SLP
+    // vectorizers.
+    std::unique_ptr<OptimizerPool> KernelOpt;
+    std::unique_ptr<KaleidoscopeObjectCache> Cache;
+    CountingMemoryMapper Memory;
+    // With JITOptions::PerfMap. LLVM's perf and gdb listeners are shared by
+    // the whole process, this one and VTune's are the JIT's own.
+    std::unique_ptr<PerfMapListener> PerfMap;
+    std::unique_ptr<JITEventListener> IntelEvents;
+    std::unique_ptr<LLJIT> J;
+    // With compile threads, where J's materialization tasks run: ours rather
+    // than LLJIT's own pool, so that waitForCompiles() can wait for it.
+    std::unique_ptr<ThreadPool> CompileThreads;
+
+    std::unique_ptr<LazyCallThroughManager> CallThrough;
+    std::unique_ptr<IndirectStubsManager> Stubs;
+    // The implementation each stub is meant to reach, call-throughs taken
+    // after their stub was pointed elsewhere must not point it back.
+    std::mutex StubsLock;
+    StringMap<std::string> StubTargets;
+
+    KaleidoscopeJIT() = default;
+
+    // Where a call-through that fails to compile its target goes.
+    static void reportCallThroughError() {
+        fprintf(stderr, "Error: failed to compile a function on its first "
+                        "call\n");
+        abort();
+    }
+
+    public:
+    // The shared library that implements VecLib, null if there's none to
+    // load on this kind of host.
+    static const char *
+    getVectorLibraryFile(TargetLibraryInfoImpl::VectorLibrary VecLib) {
+        switch (VecLib) {
+        case TargetLibraryInfoImpl::LIBMVEC_X86: return "libmvec.so.1";
+        case TargetLibraryInfoImpl::SVML: return "libsvml.so";
+        case TargetLibraryInfoImpl::MASSV: return "libmassv.so";
+        default: return nullptr;
+        }
+    }
+
+    // Describe the target code is generated for: the host, with all of its
+    // CPU features, unless Options names another CPU.
+    static Expected<JITTargetMachineBuilder>
+    getTargetMachineBuilder(const JITOptions &Options) {
+        auto JTMB = JITTargetMachineBuilder::detectHost();
+        if (!JTMB)
+            return JTMB.takeError();
+        if (!Options.CPU.empty()) {
+            // The host's features may not exist on that CPU, use its own.
+            JTMB->setCPU(Options.CPU);
+            JTMB->getFeatures() = SubtargetFeatures();
+        }
+        if (Options.FuseFPOps)
+            JTMB->getOptions().AllowFPOpFusion = FPOpFusion::Fast;
+        return JTMB;
+    }
+
+    static Expected<std::unique_ptr<KaleidoscopeJIT>>
+    Create(const JITOptions &Options) {
+        std::unique_ptr<KaleidoscopeJIT> KJ(new KaleidoscopeJIT());
+
+        auto JTMB = getTargetMachineBuilder(Options);
+        if (!JTMB)
+            return JTMB.takeError();
+
+        if (!Options.CacheDir.empty()) {
+            // Everything besides the IR that the generated code depends on.
+            std::string Config;
+            raw_string_ostream OS(Config);
+            OS << JTMB->getTargetTriple().str() << ' ' << JTMB->getCPU()
+               << ' ' << JTMB->getFeatures().getString() << " O"
+               << Options.Level.getSpeedupLevel() << 's'
+               << Options.Level.getSizeLevel() << " fuse"
+               << JTMB->getOptions().AllowFPOpFusion << " ipo"
+               << Options.Interprocedural << " veclib" << Options.VecLib;
+            auto Cache = KaleidoscopeObjectCache::Create(Options.CacheDir,
+                                                         OS.str());
+            if (!Cache)
+                return Cache.takeError();
+            KJ->Cache = std::move(*Cache);
+        }
+
+        // This is LLJIT's default compiler, plus the object cache and
+        // timing.
+        auto CreateCompiler = [Cache = KJ->Cache.get(), Stats = Options.Stats,
+                               Threaded = Options.NumCompileThreads > 0](
+                JITTargetMachineBuilder JTMB)
+                -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+            std::unique_ptr<IRCompileLayer::IRCompiler> C;
+            if (Threaded) {
+                C = std::make_unique<ConcurrentIRCompiler>(std::move(JTMB),
+                                                           Cache);
+            } else {
+                auto TM = JTMB.createTargetMachine();
+                if (!TM)
+                    return TM.takeError();
+                C = std::make_unique<TMOwningSimpleCompiler>(std::move(*TM),
+                                                             Cache);
+            }
+            if (Stats)
+                C = std::make_unique<TimedIRCompiler>(std::move(C), *Stats);
+            return C;
+        };
+
+        // The optimizer tunes the IR for the same target the compiler
+        // emits code for.
+        KJ->Opt = std::make_unique<OptimizerPool>(
+            Options.Level, *JTMB, Options.Interprocedural, Options.VecLib);
+        KJ->KernelOpt = std::make_unique<OptimizerPool>(
+            OptimizationLevel::O3, *JTMB, /*Interprocedural=*/false,
+            Options.VecLib);
+
+        // LLJIT's default object layer, with the pages counted and, with
+        // PerfMap, every object reported to the profilers and debuggers. The
+        // JIT event listeners LLVM wasn't built with are null.
+        std::vector<JITEventListener *> Listeners;
+        if (Options.PerfMap) {
+            KJ->PerfMap = std::make_unique<PerfMapListener>();
+            KJ->IntelEvents.reset(
+                JITEventListener::createIntelJITEventListener());
+            Listeners = {KJ->PerfMap.get(), KJ->IntelEvents.get(),
+                         JITEventListener::createPerfJITEventListener(),
+                         JITEventListener::createGDBRegistrationListener()};
+        }
+        auto CreateObjectLayer = [Memory = &KJ->Memory, Listeners](
+                ExecutionSession &ES, const Triple &)
+                -> Expected<std::unique_ptr<ObjectLayer>> {
+            auto Layer = std::make_unique<RTDyldObjectLinkingLayer>(
+                ES, [Memory] {
+                    return std::make_unique<SectionMemoryManager>(Memory);
+                });
+            for (JITEventListener *L : Listeners)
+                if (L)
+                    Layer->registerJITEventListener(*L);
+            return Layer;
+        };
+
+        auto J = LLJITBuilder()
+                     .setJITTargetMachineBuilder(std::move(*JTMB))
+                     .setNumCompileThreads(Options.NumCompileThreads)
+                     .setCompileFunctionCreator(std::move(CreateCompiler))
+                     .setObjectLinkingLayerCreator(std::move(CreateObjectLayer))
+                     .create();
+        if (!J)
+            return J.takeError();
+        KJ->J = std::move(*J);
+        if (Options.NumCompileThreads) {
+            KJ->CompileThreads = std::make_unique<ThreadPool>(
+                hardware_concurrency(Options.NumCompileThreads));
+            KJ->J->getExecutionSession().setDispatchTask(
+                [Pool = KJ->CompileThreads.get()](std::unique_ptr<Task> T) {
+                    // ThreadPool only takes tasks it can copy.
+                    std::shared_ptr<Task> Shared(std::move(T));
+                    Pool->async([Shared] { Shared->run(); });
+                });
+        }
+
+        // Optimize modules on their way to the compiler.
+        KJ->J->getIRTransformLayer().setTransform(
+            [O = KJ->Opt.get(), Stats = Options.Stats](
+                    ThreadSafeModule TSM,
+                    const MaterializationResponsibility &)
+                -> Expected<ThreadSafeModule> {
+                if (auto Err = TSM.withModuleDo([&](Module &M) -> Error {
+                        if (Stats)
+                            Stats->countInstructions(M, /*Optimized=*/false);
+                        {
+                            CompileStats::PhaseTimer T(Stats,
+                                                       CompileStats::Optimize);
+                            if (auto Err = O->run(M))
+                                return Err;
+                        }
+                        if (Stats)
+                            Stats->countInstructions(M, /*Optimized=*/true);
+                        return Error::success();
+                    }))
+                    return Err;
+                return TSM;
+            });
+
+        // Expose the symbols of the host process (libc, libm...) to JITed
+        // code, and those of the vector library the vectorizers call. They
+        // are searched after the main JITDylib, from one of their own, so
+        // that a definition can still take the name of one already used.
+        if (const char *File = getVectorLibraryFile(Options.VecLib)) {
+            std::string ErrMsg;
+            if (sys::DynamicLibrary::LoadLibraryPermanently(File, &ErrMsg))
+                return createStringError(inconvertibleErrorCode(),
+                                         "could not load %s: %s", File,
+                                         ErrMsg.c_str());
+        }
+        auto ProcessSymbols =
+            DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                KJ->J->getDataLayout().getGlobalPrefix());
+        if (!ProcessSymbols)
+            return ProcessSymbols.takeError();
+        JITDylib &Process =
+            KJ->J->getExecutionSession().createBareJITDylib("<process>");
+        Process.addGenerator(std::move(*ProcessSymbols));
+        KJ->J->getMainJITDylib().addToLinkOrder(Process);
+
+        const Triple &TT = KJ->J->getTargetTriple();
+        auto CallThrough = createLocalLazyCallThroughManager(
+            TT, KJ->J->getExecutionSession(),
+            pointerToJITTargetAddress(&reportCallThroughError));
+        if (!CallThrough)
+            return CallThrough.takeError();
+        KJ->CallThrough = std::move(*CallThrough);
+        auto StubsBuilder = createLocalIndirectStubsManagerBuilder(TT);
+        if (!StubsBuilder)
+            return createStringError(inconvertibleErrorCode(),
+                                     "no indirect stubs for target %s",
+                                     TT.str().c_str());
+        KJ->Stubs = StubsBuilder();
+
+        return KJ;
+    }
+
+    ~KaleidoscopeJIT() {
+        // Tasks still running use the session J is about to end.
+        waitForCompiles();
+    }
+
+    const DataLayout &getDataLayout() const { return J->getDataLayout(); }
+
+    const Triple &getTargetTriple() const { return J->getTargetTriple(); }
+
+    JITDylib &getMainJITDylib() { return J->getMainJITDylib(); }
+
+    // The memory mapped for compiled code and data, now and at most.
+    size_t getCodeMemory() const { return Memory.getMappedBytes(); }
+    size_t getPeakCodeMemory() const { return Memory.getPeakMappedBytes(); }
+
+    // Add a module to the JIT, if RT is null the module is owned by the
+    // main JITDylib's default resource tracker.
+    Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+        if (!RT)
+            RT = J->getMainJITDylib().getDefaultResourceTracker();
+        return J->addIRModule(RT, std::move(TSM));
+    }
+
+    // Add a module of batch kernels, which is optimized at -O3 whatever the
+    // JIT's level (on top of the usual optimization when it is compiled).
+    Error addKernelModule(ThreadSafeModule TSM,
+                          ResourceTrackerSP RT = nullptr) {
+        if (auto Err = TSM.withModuleDo(
+                [this](Module &M) { return KernelOpt->run(M); }))
+            return Err;
+        return addModule(std::move(TSM), std::move(RT));
+    }
+
+    // Make Name a stub that calls ImplName, defining the stub the first time
+    // and repointing it after that. ImplName is looked up (so compiled) on
+    // the first call through the stub, which then jumps straight to it.
+    Error setStubTarget(StringRef Name, StringRef ImplName) {
+        auto Trampoline = CallThrough->getCallThroughTrampoline(
+            J->getMainJITDylib(), J->mangleAndIntern(ImplName),
+            [this, Name = Name.str(), ImplName = ImplName.str()](
+                    JITTargetAddress Addr) -> Error {
+                std::lock_guard<std::mutex> Guard(StubsLock);
+                if (StubTargets[Name] != ImplName)
+                    return Error::success();
+                return Stubs->updatePointer(Name, Addr);
+            });
+        if (!Trampoline)
+            return Trampoline.takeError();
+
+        std::lock_guard<std::mutex> Guard(StubsLock);
+        auto Target = StubTargets.try_emplace(Name, ImplName.str());
+        if (!Target.second) {
+            Target.first->second = ImplName.str();
+            return Stubs->updatePointer(Name, *Trampoline);
+        }
+        if (auto Err = Stubs->createStub(Name, *Trampoline,
+                                         JITSymbolFlags::Exported |
+                                             JITSymbolFlags::Callable))
+            return Err;
+        return J->getMainJITDylib().define(absoluteSymbols(
+            {{J->mangleAndIntern(Name), Stubs->findStub(Name, false)}}));
+    }
+
+    // Start compiling the function Name without waiting for it to be done,
+    // with compile threads this lets the caller get on with something else.
+    void compileInBackground(StringRef Name) {
+        auto &ES = J->getExecutionSession();
+        ES.lookup(LookupKind::Static,
+                  makeJITDylibSearchOrder(&J->getMainJITDylib()),
+                  SymbolLookupSet(J->mangleAndIntern(Name)),
+                  SymbolState::Ready,
+                  [&ES](Expected<SymbolMap> Result) {
+                      if (!Result)
+                          ES.reportError(Result.takeError());
+                  },
+                  NoDependenciesToRegister);
+    }
+
+    // Wait until the compile threads have nothing left to do. A lookup
+    // returns as soon as its symbols are ready, but the task that compiled
+    // them may still be recording their memory with their resource tracker:
+    // trackers must only be removed once that is over.
+    void waitForCompiles() {
+        if (CompileThreads)
+            CompileThreads->wait();
+    }
+
+    // Look up a symbol by its IR name, compiling it if needed. Searches
+    // where JITed code does, the host process after the JIT's own symbols.
+    Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
+        JITDylibSearchOrder Order;
+        J->getMainJITDylib().withLinkOrderDo(
+            [&](const JITDylibSearchOrder &O) { Order = O; });
+        return J->getExecutionSession().lookup(Order,
+                                               J->mangleAndIntern(Name));
+    }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_JIT_H
@@ -0,0 +1,117 @@
+#ifndef KALEIDOSCOPE_OBJECTCACHE_H
+#define KALEIDOSCOPE_OBJECTCACHE_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm {
+
+// KaleidoscopeObjectCache - Keeps the object files the JIT emits in a cache
+// directory, so the next process compiling the same code maps the object in
+// instead of running code generation again.
+//
+// Objects are keyed by a hash of the module's optimized IR (as bitcode)
+// together with everything else that affects code generation: the target
+// triple, CPU, features and optimization level, passed in as Config.
+class KaleidoscopeObjectCache : public ObjectCache {
+    std::string CacheDir;
+    std::string Config;
+
+    // Keys computed by getObject() for modules that missed, so that
+    // notifyObjectCompiled() doesn't have to hash them again.
+    std::mutex Lock;
+    DenseMap<const Module *, std::string> PendingKeys;
+
+    std::string getKey(const Module *M) {
+        SmallVector<char, 0> Bitcode;
+        raw_svector_ostream OS(Bitcode);
+        WriteBitcodeToFile(*M, OS);
+
+        SHA1 Hasher;
+        Hasher.update(Config);
+        Hasher.update(StringRef(Bitcode.data(), Bitcode.size()));
+        return toHex(Hasher.final(), /*LowerCase=*/true);
+    }
+
+    std::string getPath(StringRef Key) const {
+        SmallString<128> Path(CacheDir);
+        sys::path::append(Path, Key + ".o");
+        return std::string(Path);
+    }
+
+    KaleidoscopeObjectCache(std::string CacheDir, std::string Config)
+        : CacheDir(std::move(CacheDir)), Config(std::move(Config)) {}
+
+    public:
+    static Expected<std::unique_ptr<KaleidoscopeObjectCache>>
+    Create(StringRef CacheDir, StringRef Config) {
+        if (auto EC = sys::fs::create_directories(CacheDir))
+            return createStringError(EC, "cannot create cache directory '%s'",
+                                     CacheDir.str().c_str());
+        return std::unique_ptr<KaleidoscopeObjectCache>(
+            new KaleidoscopeObjectCache(CacheDir.str(), Config.str()));
+    }
+
+    std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+        std::string Key = getKey(M);
+        // Objects don't need a null terminator, which lets MemoryBuffer map
+        // them rather than read them.
+        auto Obj = MemoryBuffer::getFile(getPath(Key), /*IsText=*/false,
+                /*RequiresNullTerminator=*/false);
+        if (Obj)
+            return std::move(*Obj);
+
+        std::lock_guard<std::mutex> Guard(Lock);
+        PendingKeys[M] = std::move(Key);
+        return nullptr;
+    }
+
+    void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+        std::string Key;
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            auto I = PendingKeys.find(M);
+            if (I == PendingKeys.end())
+                return;
+            Key = std::move(I->second);
+            PendingKeys.erase(I);
+        }
+
+        // Write to a temporary file first and rename it into place so that
+        // concurrent compiles, in this process or another one, never see a
+        // partially written object. Failing to cache is not an error.
+        SmallString<128> TmpPath;
+        int FD;
+        if (sys::fs::createUniqueFile(getPath(Key) + ".tmp%%%%%%", FD,
+                                      TmpPath))
+            return;
+        {
+            raw_fd_ostream OS(FD, /*shouldClose=*/true);
+            OS << Obj.getBuffer();
+            if (OS.has_error()) {
+                OS.clear_error();
+                sys::fs::remove(TmpPath);
+                return;
+            }
+        }
+        if (sys::fs::rename(TmpPath, getPath(Key)))
+            sys::fs::remove(TmpPath);
+    }
+};
+
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_OBJECTCACHE_H
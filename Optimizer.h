@@ -0,0 +1,212 @@
+#ifndef KALEIDOSCOPE_OPTIMIZER_H
+#define KALEIDOSCOPE_OPTIMIZER_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/SCCP.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+
+namespace llvm {
+
+// Optimizer - Optimization pipeline for a given -O level, built once with the
+// new PassBuilder and then run over every module that is compiled.
+//
+//  -O0     Nothing beyond what is required for correctness, and promoting
+//          variables from stack slots back to registers.
+//  -O1     The classic Kaleidoscope function passes, cheap and good enough
+//          for the REPL.
+//  -O2/-O3 LLVM's default module pipelines, with inlining, function
+//          attribute inference, the loop and SLP vectorizers...
+//
+// An interprocedural Optimizer is meant for modules holding a whole program
+// (or library) rather than a definition or two: at -O1 it also propagates
+// constants across calls, inlines callees into their callers and drops the
+// functions left unused. The -O2/-O3 pipelines do all of that anyway.
+//
+// With a vector library, the vectorizers may turn calls of math functions in
+// loops into calls of that library's SIMD variants.
+class Optimizer {
+    // The analysis managers refer back into the PassBuilder, so it has to
+    // stay around as long as they do.
+    PassBuilder PB;
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    ModulePassManager MPM;
+
+    // PassBuilder leaves the vectorizers off, -O2 and -O3 turn them on as
+    // clang's do.
+    static PipelineTuningOptions getTuningOptions(OptimizationLevel Level) {
+        PipelineTuningOptions PTO;
+        PTO.LoopVectorization = Level.getSpeedupLevel() > 1;
+        PTO.SLPVectorization = Level.getSpeedupLevel() > 1;
+        return PTO;
+    }
+
+    public:
+    // TM, if given, is used to query the target while optimizing and must
+    // outlive the Optimizer.
+    Optimizer(OptimizationLevel Level, TargetMachine *TM = nullptr,
+              bool Interprocedural = false,
+              TargetLibraryInfoImpl::VectorLibrary VecLib =
+                  TargetLibraryInfoImpl::NoLibrary)
+        : PB(TM, getTuningOptions(Level)) {
+        if (VecLib != TargetLibraryInfoImpl::NoLibrary) {
+            // Registered ahead of PassBuilder's own, which would win
+            // otherwise.
+            TargetLibraryInfoImpl TLII(TM ? TM->getTargetTriple()
+                                          : Triple(sys::getProcessTriple()));
+            TLII.addVectorizableFunctionsFromVecLib(VecLib);
+            FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+        }
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+        if (Level == OptimizationLevel::O0) {
+            MPM = PB.buildO0DefaultPipeline(Level);
+            // Every variable is an alloca, leaving them in memory makes even
+            // unoptimized code needlessly slow.
+            MPM.addPass(createModuleToFunctionPassAdaptor(PromotePass()));
+        } else if (Level == OptimizationLevel::O1) {
+            FunctionPassManager FPM;
+            // Promote allocas to registers, breaking up aggregates first.
+            FPM.addPass(SROAPass());
+            // Peephole optimizations, Peephole optimizations are performed on
+            // a small set of operations replacing them by faster
+            // implementations for example consider the following code :
+            // b = a + a
+            // This would be replaced by a left shift on A (equivalent to mul
+            // by two).
+            FPM.addPass(InstCombinePass());
+            // Reassociate expressions.
+            FPM.addPass(ReassociatePass());
+            // Eliminate Common SubExpressions, CSE eliminates repetitive
+            // expressions for example consider the following code :
+            // x1 = y * z + b1;
+            // x2 = y * z + b2;
+            // CSE will rewrite it as follows :
+            // t = y * z;
+            // x1 = t + b1;
+            // x2 = t + b2;
+            FPM.addPass(GVNPass());
+            // CFG simplification will simplify the control flow graph by
+            // removing dead code or eliminating impossible branches (e.g if a
+            // constant is compared to another compile time value).
+            FPM.addPass(SimplifyCFGPass());
+            if (Interprocedural) {
+                // Fold arguments that are the same constant at every call
+                // site, and return values that are always the same constant.
+                MPM.addPass(IPSCCPPass());
+                // Walk the call graph bottom up, simplifying each function
+                // with the passes above before deciding whether to inline it
+                // into its callers.
+                ModuleInlinerWrapperPass Inliner(getInlineParams(
+                    Level.getSpeedupLevel(), Level.getSizeLevel()));
+                Inliner.getPM().addPass(
+                    createCGSCCToFunctionPassAdaptor(std::move(FPM)));
+                MPM.addPass(std::move(Inliner));
+                // Delete the internal functions nothing calls any more.
+                MPM.addPass(GlobalDCEPass());
+            } else {
+                MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+            }
+        } else {
+            MPM = PB.buildPerModuleDefaultPipeline(Level);
+        }
+    }
+
+    Optimizer(const Optimizer &) = delete;
+    Optimizer &operator=(const Optimizer &) = delete;
+
+    void run(Module &M) {
+        MPM.run(M, MAM);
+
+        // Cached analyses refer to M by address, drop them before M goes
+        // away.
+        LAM.clear();
+        FAM.clear();
+        CGAM.clear();
+        MAM.clear();
+    }
+};
+
+// OptimizerPool - Optimizers for modules compiled on several threads at once.
+// Pass managers can't be shared between threads, so each run borrows an
+// Optimizer nobody else is using, and the pool only ever builds as many as
+// there are threads optimizing concurrently. Each Optimizer gets its own
+// TargetMachine, built by JTMB, to tune the IR for.
+class OptimizerPool {
+    struct Entry {
+        std::unique_ptr<TargetMachine> TM;
+        std::unique_ptr<Optimizer> Opt; // Refers to TM.
+    };
+
+    OptimizationLevel Level;
+    bool Interprocedural;
+    TargetLibraryInfoImpl::VectorLibrary VecLib;
+    orc::JITTargetMachineBuilder JTMB;
+    std::mutex Lock;
+    std::vector<Entry> Free;
+
+    public:
+    OptimizerPool(OptimizationLevel Level, orc::JITTargetMachineBuilder JTMB,
+                  bool Interprocedural = false,
+                  TargetLibraryInfoImpl::VectorLibrary VecLib =
+                      TargetLibraryInfoImpl::NoLibrary)
+        : Level(Level), Interprocedural(Interprocedural), VecLib(VecLib),
+          JTMB(std::move(JTMB)) {}
+
+    Error run(Module &M) {
+        Entry E;
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            if (!Free.empty()) {
+                E = std::move(Free.back());
+                Free.pop_back();
+            }
+        }
+        if (!E.Opt) {
+            auto TM = JTMB.createTargetMachine();
+            if (!TM)
+                return TM.takeError();
+            E.TM = std::move(*TM);
+            E.Opt = std::make_unique<Optimizer>(Level, E.TM.get(),
+                                                Interprocedural, VecLib);
+        }
+
+        E.Opt->run(M);
+
+        std::lock_guard<std::mutex> Guard(Lock);
+        Free.push_back(std::move(E));
+        return Error::success();
+    }
+};
+
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_OPTIMIZER_H
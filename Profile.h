@@ -0,0 +1,120 @@
+#ifndef KALEIDOSCOPE_PROFILE_H
+#define KALEIDOSCOPE_PROFILE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace llvm {
+
+// Profile - How often the parts of each definition ran, as counted by
+// instrumented code (see CompilerOptions::ProfileGenerate) and kept in a
+// profile file for later compiles to optimize with. Each definition, by
+// name, has a row of counters:
+//
+//   [0]        the number of calls
+//   per if     the times it took its then and its else arm
+//   per for    the iterations of its body and the times it was left
+//
+// with the ifs and fors in the order they appear in the source. The file has
+// a line per definition: its name followed by its counters.
+class Profile {
+    StringMap<std::vector<uint64_t>> Rows;
+
+    public:
+    static Expected<Profile> read(StringRef Path) {
+        auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/true);
+        if (!Buf)
+            return createStringError(Buf.getError(), "could not read '%s'",
+                                     Path.str().c_str());
+        Profile P;
+        SmallVector<StringRef, 16> Lines, Fields;
+        (*Buf)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+        for (unsigned I = 0; I != Lines.size(); ++I) {
+            StringRef Line = Lines[I].trim();
+            if (Line.empty() || Line.startswith("#"))
+                continue;
+            Fields.clear();
+            Line.split(Fields, ' ', -1, /*KeepEmpty=*/false);
+            std::vector<uint64_t> &Row = P.Rows[Fields[0]];
+            Row.clear();
+            for (StringRef Field : drop_begin(Fields)) {
+                uint64_t Count;
+                if (Field.getAsInteger(10, Count))
+                    return createStringError(inconvertibleErrorCode(),
+                                             "%s:%u: invalid count '%s'",
+                                             Path.str().c_str(), I + 1,
+                                             Field.str().c_str());
+                Row.push_back(Count);
+            }
+            if (Row.empty())
+                return createStringError(inconvertibleErrorCode(),
+                                         "%s:%u: no counts for '%s'",
+                                         Path.str().c_str(), I + 1,
+                                         Fields[0].str().c_str());
+        }
+        return P;
+    }
+
+    Error write(StringRef Path) const {
+        std::error_code EC;
+        raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+        if (EC)
+            return createStringError(EC, "could not open '%s'",
+                                     Path.str().c_str());
+        OS << "# Kaleidoscope profile: name, calls, then two counts per "
+              "if and per for\n";
+        // Sorted, so that profiles of the same program can be diffed.
+        std::vector<StringRef> Names;
+        for (auto &Row : Rows)
+            Names.push_back(Row.first());
+        llvm::sort(Names);
+        for (StringRef Name : Names) {
+            OS << Name;
+            for (uint64_t Count : Rows.lookup(Name))
+                OS << ' ' << Count;
+            OS << '\n';
+        }
+        return Error::success();
+    }
+
+    // The counters of Name, none if it didn't run.
+    ArrayRef<uint64_t> lookup(StringRef Name) const {
+        auto I = Rows.find(Name);
+        if (I == Rows.end())
+            return {};
+        return I->second;
+    }
+    void set(StringRef Name, std::vector<uint64_t> Counters) {
+        Rows[Name] = std::move(Counters);
+    }
+    bool empty() const { return Rows.empty(); }
+
+    // What the optimizer's ProfileSummaryInfo needs to tell hot code from
+    // cold, for the whole profile.
+    std::unique_ptr<ProfileSummary> getSummary() const {
+        InstrProfSummaryBuilder Builder(ProfileSummaryBuilder::DefaultCutoffs);
+        for (auto &Row : Rows)
+            Builder.addRecord(InstrProfRecord(Row.second));
+        return Builder.getSummary();
+    }
+};
+
+} // end namespace llvm
+
+#endif // KALEIDOSCOPE_PROFILE_H
@@ -0,0 +1,115 @@
+#ifndef KALEIDOSCOPE_SOURCEBUFFER_H
+#define KALEIDOSCOPE_SOURCEBUFFER_H
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+// SourceBuffer - The input the lexer scans. The bytes in [Cur, End) are the
+// not yet lexed part of the input and *End is always a '\0' sentinel, so the
+// lexer can scan with bare pointers and only has to compare against End when
+// it sees a '\0'. Once the lexer reaches End it calls refill() to ask for
+// more input.
+class SourceBuffer {
+    protected:
+    const char *Cur = nullptr;
+    const char *End = nullptr;
+    // Base is at byte offset BaseOffset of the whole input.
+    const char *Base = nullptr;
+    size_t BaseOffset = 0;
+
+    public:
+    virtual ~SourceBuffer() = default;
+
+    const char *getCur() const { return Cur; }
+    const char *getEnd() const { return End; }
+    // Mark everything before P as consumed.
+    void setCur(const char *P) { Cur = P; }
+    // Byte offset of P (which must be in [Cur, End]) from the start of the
+    // input, stays meaningful across refills.
+    size_t getOffset(const char *P) const { return BaseOffset + (P - Base); }
+
+    // Pull more input into the buffer, the unconsumed bytes [Cur, End) are
+    // kept (and may move). Returns false once the input is exhausted.
+    virtual bool refill() { return false; }
+};
+
+// FileSourceBuffer - Source buffer over a whole file, large files are memory
+// mapped so lexing them doesn't copy anything.
+class FileSourceBuffer : public SourceBuffer {
+    std::unique_ptr<llvm::MemoryBuffer> MB;
+
+    FileSourceBuffer(std::unique_ptr<llvm::MemoryBuffer> MB)
+        : MB(std::move(MB)) {
+        Base = Cur = this->MB->getBufferStart();
+        End = this->MB->getBufferEnd();
+    }
+
+    public:
+    static llvm::ErrorOr<std::unique_ptr<SourceBuffer>>
+    create(const llvm::Twine &Path) {
+        // MemoryBuffer guarantees the buffer is null terminated.
+        auto MB = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                /*RequiresNullTerminator=*/true);
+        if (!MB)
+            return MB.getError();
+        return std::unique_ptr<SourceBuffer>(
+            new FileSourceBuffer(std::move(*MB)));
+    }
+};
+
+// StringSourceBuffer - Source buffer over a string in memory, which isn't
+// copied and so must outlive the buffer. std::string is always followed by a
+// '\0', which serves as the sentinel.
+class StringSourceBuffer : public SourceBuffer {
+    public:
+    explicit StringSourceBuffer(const std::string &Text) {
+        Base = Cur = Text.c_str();
+        End = Text.c_str() + Text.size();
+    }
+};
+
+// StdinSourceBuffer - Source buffer reading stdin in large chunks. A read
+// returns as soon as some input is available, so interactive (REPL) use
+// still sees each line as soon as it's typed.
+class StdinSourceBuffer : public SourceBuffer {
+    static constexpr size_t ChunkSize = 64 * 1024;
+    std::vector<char> Buf;
+
+    public:
+    StdinSourceBuffer() : Buf(ChunkSize + 1) {
+        Buf[0] = '\0';
+        Base = Cur = End = Buf.data();
+    }
+
+    bool refill() override {
+        // Move the unconsumed tail to the front of the buffer and make room
+        // for one more chunk after it.
+        size_t Kept = End - Cur;
+        BaseOffset += Cur - Base;
+        memmove(Buf.data(), Cur, Kept);
+        if (Buf.size() < Kept + ChunkSize + 1)
+            Buf.resize(Kept + ChunkSize + 1);
+
+        ssize_t N;
+        do
+            N = read(STDIN_FILENO, Buf.data() + Kept, ChunkSize);
+        while (N < 0 && errno == EINTR);
+        if (N < 0)
+            N = 0;
+
+        Base = Cur = Buf.data();
+        End = Buf.data() + Kept + N;
+        Buf[Kept + N] = '\0';
+        return N > 0;
+    }
+};
+
+#endif // KALEIDOSCOPE_SOURCEBUFFER_H
@@ -0,0 +1,320 @@
+// kaleidoscope-bench - Throughput of each phase of the compiler (lexing,
+// parsing, IR generation, optimization, JIT compilation and execution) over
+// generated programs.
+//
+// Each benchmark times one phase only: whatever the phase needs done first
+// (e.g. parsing, before IR generation) is done with the timer paused.
+
+// C++ STL imports
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// LLVM imports
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "benchmark/benchmark.h"
+
+#include "Kaleidoscope.h"
+#include "KaleidoscopeJIT.h"
+#include "Optimizer.h"
+#include "SourceBuffer.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+namespace {
+
+ExitOnError ExitOnErr;
+
+// Workload - A generated program, and the functions it defines.
+struct Workload {
+    std::string Source;
+    std::vector<std::string> Functions;
+};
+
+enum WorkloadKind {
+    ManyDefs,  // N small independent definitions.
+    HugeExpr,  // One definition whose body is an expression of N terms.
+    CallChain, // N definitions, each calling the previous one.
+    Fib,       // Recursive fib, N is unused.
+};
+
+Workload generate(WorkloadKind Kind, int64_t N) {
+    Workload W;
+    std::string &S = W.Source;
+    switch (Kind) {
+    case ManyDefs:
+        for (int64_t i = 0; i != N; ++i) {
+            std::string Name = "f" + std::to_string(i);
+            S += "def " + Name + "(x y) x * y + " + std::to_string(i) +
+                 " - (x < y) * (y - " + std::to_string(i % 7) + ");\n";
+            W.Functions.push_back(Name);
+        }
+        break;
+    case HugeExpr: {
+        static const char Ops[] = {'+', '*', '-', '+'};
+        S += "def big(x y)\n  x";
+        for (int64_t i = 1; i != N; ++i) {
+            S += ' ';
+            S += Ops[i % 4];
+            S += i % 3 ? " y" : " " + std::to_string(i % 100) + ".5";
+            if (i % 8 == 0)
+                S += "\n ";
+        }
+        S += ";\n";
+        W.Functions.push_back("big");
+        break;
+    }
+    case CallChain:
+        S += "def c0(x) x + 1;\n";
+        W.Functions.push_back("c0");
+        for (int64_t i = 1; i != N; ++i) {
+            std::string Name = "c" + std::to_string(i);
+            S += "def " + Name + "(x) c" + std::to_string(i - 1) +
+                 "(x) * 0.5 + x;\n";
+            W.Functions.push_back(Name);
+        }
+        break;
+    case Fib:
+        S += "def fib(x)\n"
+             "  if x < 3 then\n"
+             "    1\n"
+             "  else\n"
+             "    fib(x - 1) + fib(x - 2);\n";
+        W.Functions.push_back("fib");
+        break;
+    }
+    return W;
+}
+
+// Workloads are generated once and reused by every benchmark.
+const Workload &getWorkload(WorkloadKind Kind, int64_t N) {
+    static std::map<std::pair<int, int64_t>, Workload> Cache;
+    auto I = Cache.find({Kind, N});
+    if (I == Cache.end())
+        I = Cache.emplace(std::make_pair(int(Kind), N), generate(Kind, N))
+                .first;
+    return I->second;
+}
+
+CompilerOptions getOptions(bool AheadOfTime,
+                           OptimizationLevel Level = OptimizationLevel::O1) {
+    CompilerOptions Options;
+    Options.JIT.Level = Level;
+    Options.AheadOfTime = AheadOfTime;
+    Options.Lazy = false;
+    Options.PrintIR = false;
+    return Options;
+}
+
+std::unique_ptr<KaleidoscopeSession> createSession(
+        const CompilerOptions &Options) {
+    return ExitOnErr(KaleidoscopeSession::Create(Options));
+}
+
+// Parse the definitions of the current source, keeping their AST (until the
+// next ResetAST()). Returns false on a parse error.
+bool parseAll(KaleidoscopeSession &S,
+              std::vector<std::unique_ptr<FunctionAST>> &Defs) {
+    S.getNextToken();
+    while (true) {
+        switch (S.getCurTok().Kind) {
+        case tok_eof:
+            return true;
+        case ';':
+            S.getNextToken();
+            break;
+        case tok_def:
+            Defs.push_back(S.ParseDefinition());
+            if (!Defs.back())
+                return false;
+            break;
+        default:
+            return false; // The workloads only have definitions.
+        }
+    }
+}
+
+// Parse W and generate IR for it into the current module, untimed.
+void codegenAll(benchmark::State &State, KaleidoscopeSession &S,
+                const Workload &W) {
+    S.setSource(std::make_unique<StringSourceBuffer>(W.Source), false);
+    std::vector<std::unique_ptr<FunctionAST>> Defs;
+    if (!parseAll(S, Defs))
+        State.SkipWithError("parse error");
+    for (auto &Def : Defs)
+        if (!S.codegen(*Def))
+            State.SkipWithError("codegen error");
+    S.ResetAST();
+}
+
+void setItemsAndBytes(benchmark::State &State, const Workload &W,
+                      int64_t ItemsPerIteration) {
+    State.SetItemsProcessed(State.iterations() * ItemsPerIteration);
+    State.SetBytesProcessed(State.iterations() * W.Source.size());
+}
+
+// Lexing, items are tokens.
+void BM_Lex(benchmark::State &State, WorkloadKind Kind) {
+    const Workload &W = getWorkload(Kind, State.range(0));
+    auto S = createSession(getOptions(/*AheadOfTime=*/true));
+    int64_t NumTokens = 0;
+    for (auto _ : State) {
+        S->setSource(std::make_unique<StringSourceBuffer>(W.Source), false);
+        NumTokens = 0;
+        while (S->getNextToken() != tok_eof)
+            ++NumTokens;
+    }
+    setItemsAndBytes(State, W, NumTokens);
+}
+
+// Parsing, lexing included since the parser pulls tokens as it goes. Items
+// are definitions.
+void BM_Parse(benchmark::State &State, WorkloadKind Kind) {
+    const Workload &W = getWorkload(Kind, State.range(0));
+    auto S = createSession(getOptions(/*AheadOfTime=*/true));
+    for (auto _ : State) {
+        S->setSource(std::make_unique<StringSourceBuffer>(W.Source), false);
+        std::vector<std::unique_ptr<FunctionAST>> Defs;
+        if (!parseAll(*S, Defs))
+            State.SkipWithError("parse error");
+        benchmark::DoNotOptimize(Defs.data());
+        S->ResetAST();
+    }
+    setItemsAndBytes(State, W, W.Functions.size());
+}
+
+// IR generation from already parsed definitions. Items are definitions.
+void BM_Codegen(benchmark::State &State, WorkloadKind Kind) {
+    const Workload &W = getWorkload(Kind, State.range(0));
+    auto S = createSession(getOptions(/*AheadOfTime=*/true));
+    for (auto _ : State) {
+        State.PauseTiming();
+        S->InitializeModule();
+        S->setSource(std::make_unique<StringSourceBuffer>(W.Source), false);
+        std::vector<std::unique_ptr<FunctionAST>> Defs;
+        if (!parseAll(*S, Defs))
+            State.SkipWithError("parse error");
+        State.ResumeTiming();
+
+        for (auto &Def : Defs)
+            if (!S->codegen(*Def))
+                State.SkipWithError("codegen error");
+
+        State.PauseTiming();
+        S->ResetAST();
+        State.ResumeTiming();
+    }
+    setItemsAndBytes(State, W, W.Functions.size());
+}
+
+// The optimization pipeline of an -O level over the IR of the whole
+// workload, in one module. Items are definitions.
+void BM_Optimize(benchmark::State &State, WorkloadKind Kind) {
+    const Workload &W = getWorkload(Kind, State.range(0));
+    OptimizationLevel Level = State.range(1) == 0 ? OptimizationLevel::O0
+                            : State.range(1) == 1 ? OptimizationLevel::O1
+                            : State.range(1) == 2 ? OptimizationLevel::O2
+                            : OptimizationLevel::O3;
+    CompilerOptions Options = getOptions(/*AheadOfTime=*/true, Level);
+    // The session initializes the native target the target machine needs.
+    auto S = createSession(Options);
+    auto JTMB = ExitOnErr(KaleidoscopeJIT::getTargetMachineBuilder(
+        Options.JIT));
+    auto TM = ExitOnErr(JTMB.createTargetMachine());
+    Optimizer Opt(Level, TM.get());
+    for (auto _ : State) {
+        State.PauseTiming();
+        S->InitializeModule();
+        S->getModule().setDataLayout(TM->createDataLayout());
+        S->getModule().setTargetTriple(TM->getTargetTriple().str());
+        codegenAll(State, *S, W);
+        State.ResumeTiming();
+
+        Opt.run(S->getModule());
+    }
+    setItemsAndBytes(State, W, W.Functions.size());
+}
+
+// Everything it takes to get native code from source: parsing, IR
+// generation, optimization and code generation in a fresh JIT. Items are
+// definitions.
+void BM_JITCompile(benchmark::State &State, WorkloadKind Kind) {
+    const Workload &W = getWorkload(Kind, State.range(0));
+    for (auto _ : State) {
+        State.PauseTiming();
+        auto S = createSession(getOptions(/*AheadOfTime=*/false));
+        State.ResumeTiming();
+
+        ExitOnErr(S->compile(W.Source));
+        for (auto &Name : W.Functions)
+            benchmark::DoNotOptimize(ExitOnErr(S->lookup(Name)));
+
+        // Tearing the JIT down isn't part of compiling.
+        State.PauseTiming();
+        S.reset();
+        State.ResumeTiming();
+    }
+    setItemsAndBytes(State, W, W.Functions.size());
+}
+
+// Calling JIT compiled code, at -O2. Items are calls.
+void BM_Execute(benchmark::State &State, WorkloadKind Kind) {
+    const Workload &W = getWorkload(Kind, State.range(0));
+    auto S = createSession(getOptions(/*AheadOfTime=*/false,
+                                      OptimizationLevel::O2));
+    ExitOnErr(S->compile(W.Source));
+    // Fib takes its argument from the size, the others are called with 1.
+    double Arg = Kind == Fib ? double(State.range(0)) : 1.0;
+    auto *FP = ExitOnErr(S->lookup<double(double)>(W.Functions.back()));
+    for (auto _ : State)
+        benchmark::DoNotOptimize(FP(Arg));
+    State.SetItemsProcessed(State.iterations());
+}
+
+} // end anonymous namespace
+
+BENCHMARK_CAPTURE(BM_Lex, many_defs, ManyDefs)->Arg(10000);
+BENCHMARK_CAPTURE(BM_Lex, huge_expr, HugeExpr)->Arg(100000);
+BENCHMARK_CAPTURE(BM_Lex, call_chain, CallChain)->Arg(10000);
+
+BENCHMARK_CAPTURE(BM_Parse, many_defs, ManyDefs)->Arg(10000);
+BENCHMARK_CAPTURE(BM_Parse, huge_expr, HugeExpr)->Arg(100000);
+BENCHMARK_CAPTURE(BM_Parse, call_chain, CallChain)->Arg(10000);
+
+BENCHMARK_CAPTURE(BM_Codegen, many_defs, ManyDefs)->Arg(10000);
+BENCHMARK_CAPTURE(BM_Codegen, huge_expr, HugeExpr)->Arg(100000);
+BENCHMARK_CAPTURE(BM_Codegen, call_chain, CallChain)->Arg(10000);
+
+BENCHMARK_CAPTURE(BM_Optimize, many_defs, ManyDefs)
+    ->ArgsProduct({{1000}, {1, 3}})->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Optimize, huge_expr, HugeExpr)
+    ->ArgsProduct({{10000}, {1, 3}})->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Optimize, call_chain, CallChain)
+    ->ArgsProduct({{1000}, {1, 3}})->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_JITCompile, many_defs, ManyDefs)
+    ->Arg(1000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_JITCompile, huge_expr, HugeExpr)
+    ->Arg(10000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_JITCompile, call_chain, CallChain)
+    ->Arg(1000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_CAPTURE(BM_Execute, call_chain, CallChain)->Arg(1000);
+BENCHMARK_CAPTURE(BM_Execute, fib, Fib)->Arg(25);
+
+int main(int argc, char **argv) {
+    ExitOnErr.setBanner(std::string(argv[0]) + ": ");
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
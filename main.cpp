@@ -1,612 +1,298 @@
 // C++ STL imports
-#include <algorithm>
-#include <vector>
-#include <string>
 #include <memory>
-#include <utility>
-#include <map>
+#include <string>
+#include <system_error>
+#include <vector>
 
 // C imports
 #include <cstdio>
-#include <cctype>
-#include <cstdlib>
 
 // LLVM imports
-#include "llvm/ADT/APFloat.h"
-#include "llvm/ADT/STLExtras.h"
-#include "llvm/IR/BasicBlock.h"
-#include "llvm/IR/Constants.h"
-#include "llvm/IR/DerivedTypes.h"
-#include "llvm/IR/Function.h"
-#include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LLVMContext.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
-#include "llvm/IR/Type.h"
-#include "llvm/IR/Verifier.h"
-#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-
-using namespace llvm;
-
-/**
- * Kaleidoscope is an untyped language with syntax similar to Python
- * and uses the 64-bit floating point type for all values (pattern
- * similar to NaN boxing in Lisps).
- *
- * Example of a function in Kaleidoscope:
- *
- * def fib(x)
- *  if x < 3 then
- *    1
- *  else
- *    fib(x - 1) + fib(x - 2)
- */
-
-// The lexer returns tokens defined below.
-enum Token {
-  tok_eof = - 1,
-  tok_def = -2,
-  tok_extern = -3,
-  tok_identifier = -4,
-  tok_number = -5,
-};
-
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal; // Filled in if tok_number
-
-// Return the next token from stdin.
-static int getTok() {
-  static int LastChar = ' ';
-
-  // Skip whitespace
-  while(isspace(LastChar))
-      LastChar = getchar();
-  if (isalpha(LastChar)) {
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
-        IdentifierStr += LastChar;
-    if (IdentifierStr == "def")
-        return tok_def;
-    if (IdentifierStr == "extern")
-        return tok_extern;
-    return tok_identifier;
-  }
-  if (isdigit(LastChar) || LastChar == '.') {
-    std::string NumStr;
-    do {
-        NumStr += LastChar;
-        LastChar = getchar();
-    } while (isdigit(LastChar) || LastChar == '.');
-
-    NumVal = strtod(NumStr.c_str(), nullptr);
-    return tok_number;
-  }
-  if (LastChar == '#') {
-      // Comment until end of line.
-      do
-          LastChar = getchar();
-      while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-
-      if (LastChar != EOF)
-          return getTok();
-  }
-  if (LastChar == EOF)
-      return tok_eof;
-  int ThisChar = LastChar;
-  LastChar = getchar();
-  return ThisChar;
-}
-
-// ExprAST - Base class for all expression nodes.
-class ExprAST {
-    public:
-        virtual ~ExprAST() = default;
-        virtual Value *codegen() = 0;
-};
-
-// NumberExprAST - Expression class for numeric literals like "1.0".
-class NumberExprAST: public ExprAST {
-    double Val;
-
-    public:
-    NumberExprAST(double Val) : Val(Val) {}
-    Value *codegen() override;
-};
-
-
-// VariableExprAST - Expression class for referencing a variable.
-class VariableExprAST : public ExprAST {
-    std::string Name; // Variable name.
-    public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
-    Value *codegen() override;
-};
-
-// BinaryExprAST - Expression class for a binary operator.
-class BinaryExprAST : public ExprAST {
-    char Op; // Binary operator for the expression.
-    std::unique_ptr<ExprAST> LHS, RHS; // Left and right hand side expressions.
-    public:
-    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-        std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-    Value *codegen() override;
-};
-
-// CallExprAST - Expression class for function calls.
-class CallExprAST : public ExprAST {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
-
-    public:
-    CallExprAST(const std::string &Callee,
-            std::vector<std::unique_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args)) {}
-    Value *codegen() override;
-};
-
-// PrototypeAST - This class represents the "prototype" for a function,
-// which captures its name and argument names.
-class PrototypeAST {
-    std::string Name;
-    std::vector<std::string> Args;
-
-    public:
-    PrototypeAST(const std::string &Name,std::vector<std::string> Args)
-        : Name(Name), Args(std::move(Args)) {}
-    Function *codegen();
-    const std::string &getName() const { return Name; }
-};
-
-// FunctionAST - This class represents a function definition.
-class FunctionAST {
-    std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
-
-    public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-            std::unique_ptr<ExprAST> Body)
-        : Proto(std::move(Proto)), Body(std::move(Body)) {}
-    Function *codegen();
-};
-
-static int CurTok;
-static int getNextToken() {
-    return CurTok = getTok();
-}
 
-// Log a parsing error.
-std::unique_ptr<ExprAST> LogError(const char* Str) {
-    fprintf(stderr, "Error: %s\n", Str);
-    return nullptr;
-}
+#include "CompileStats.h"
+#include "Kaleidoscope.h"
+#include "KaleidoscopeJIT.h"
+#include "Optimizer.h"
+#include "SourceBuffer.h"
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char* Str) {
-    LogError(Str);
-    return nullptr;
+using namespace llvm;
+using namespace llvm::orc;
+
+// The kaleidoscope driver: reads source files (or stdin as a REPL) and runs
+// them through the JIT, or compiles them ahead of time into files.
+
+static ExitOnError ExitOnErr;
+
+static cl::list<std::string> InputFilenames(cl::Positional,
+        cl::desc("<input files>"), cl::ZeroOrMore);
+
+static cl::opt<unsigned> ParseThreads("parse-threads",
+        cl::desc("Parse several input files on this many threads "
+                 "(default = one per core)"),
+        cl::init(0));
+
+static cl::opt<char> OptLevel("O",
+        cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] "
+                 "(default = '-O1')"),
+        cl::Prefix, cl::ZeroOrMore, cl::init('1'));
+
+static cl::opt<bool> LazyCompile("lazy",
+        cl::desc("Leave definitions to be compiled on their first call "
+                 "through their stub rather than as soon as they are read. "
+                 "No effect with --compile-threads or --tiered "
+                 "(default = on)"),
+        cl::init(true));
+
+static cl::opt<unsigned> CompileThreads("compile-threads",
+        cl::desc("Compile definitions in the background on this many "
+                 "threads as soon as they are read, instead of lazily"),
+        cl::init(0));
+
+// Ahead of time compilation: everything read goes into a single module that
+// is written out at the end instead of being run.
+static cl::opt<std::string> EmitObj("emit-obj",
+        cl::desc("Compile the definitions into a native object file"),
+        cl::value_desc("filename"));
+static cl::opt<std::string> EmitBC("emit-bc",
+        cl::desc("Write the definitions out as LLVM bitcode"),
+        cl::value_desc("filename"));
+static cl::opt<std::string> EmitLLVM("emit-llvm",
+        cl::desc("Write the definitions out as textual LLVM IR"),
+        cl::value_desc("filename"));
+
+static bool isEmittingFiles() {
+    return !EmitObj.empty() || !EmitBC.empty() || !EmitLLVM.empty();
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
-
-// Parse a number literal.
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto result = std::make_unique<NumberExprAST>(NumVal);
-    getNextToken();
-    return std::move(result);
+static cl::opt<bool> WholeFile("whole-file",
+        cl::desc("Compile the input as one module, optimized across "
+                 "definitions (inlining, interprocedural constant "
+                 "propagation...) once it has all been read. Top-level "
+                 "expressions are run at the end"));
+
+static cl::opt<bool> Tiered("tiered",
+        cl::desc("Interpret new code first, definitions are only compiled "
+                 "once they get hot (not with --whole-file)"));
+static cl::opt<unsigned> TierUpThreshold("tier-up-threshold",
+        cl::desc("Calls and loop iterations after which --tiered compiles a "
+                 "definition (default = 1000)"),
+        cl::init(1000));
+
+// Profile guided optimization: an instrumented run writes a profile that
+// later runs optimize the same definitions with.
+static cl::opt<std::string> ProfileGenerate("profile-generate",
+        cl::desc("Count what each definition does and write the counts to "
+                 "this profile file at the end"),
+        cl::value_desc("filename"));
+static cl::opt<std::string> ProfileUse("profile-use",
+        cl::desc("Optimize definitions for the counts in this profile file"),
+        cl::value_desc("filename"));
+
+static cl::opt<std::string> CacheDir("cache-dir",
+        cl::desc("Cache compiled objects in this directory and reuse them "
+                 "in later runs"),
+        cl::value_desc("directory"));
+
+// Floating point semantics. By default every operation is IEEE exact, which
+// leaves the optimizer very little to do with long sums and products.
+static cl::opt<bool> FastMath("fast-math",
+        cl::desc("Allow all fast-math transformations (implies "
+                 "--reassoc and --fp-contract)"));
+static cl::opt<bool> Reassoc("reassoc",
+        cl::desc("Allow floating point operations to be reassociated"));
+static cl::opt<bool> FPContract("fp-contract",
+        cl::desc("Allow floating point multiplies and adds to be fused"));
+
+// --stats itself is LLVM's own flag for its statistics, which are included in
+// the report.
+static cl::opt<std::string> StatsFile("stats-file",
+        cl::desc("Write the --stats report (compile times, code sizes and "
+                 "memory use, as JSON) to this file instead of stderr"),
+        cl::value_desc("filename"));
+
+// LLVM's own -vector-library flag: the SIMD math library vectorized loops
+// may call, e.g. -vector-library=LIBMVEC-X86 for glibc's libmvec. The JIT
+// has to load it too.
+static TargetLibraryInfoImpl::VectorLibrary getVectorLibrary() {
+    auto *Opt = cl::getRegisteredOptions().lookup("vector-library");
+    if (!Opt)
+        return TargetLibraryInfoImpl::NoLibrary;
+    return static_cast<cl::opt<TargetLibraryInfoImpl::VectorLibrary> *>(Opt)
+        ->getValue();
 }
 
-// Parse a parenthesized expression.
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-    getNextToken();
-    auto V = ParseExpression();
-    if (!V) {
-        return nullptr;
+static cl::opt<bool> PerfMap("perf-map",
+        cl::desc("Tell perf (in /tmp/perf-<pid>.map, and a jitdump for perf "
+                 "inject) and gdb where JITed functions are"));
+
+static cl::opt<std::string> MCPU("mcpu",
+        cl::desc("Target a specific CPU type (default = the host's)"),
+        cl::value_desc("cpu-name"));
+
+// Write the module built from the whole input to the files asked for on the
+// command line, optimized for and compiled to the host.
+static void EmitFiles(KaleidoscopeSession &Session,
+                      const JITOptions &Options) {
+    Module &M = Session.getModule();
+    CompileStats *Stats = Options.Stats;
+    OptimizationLevel Level = Options.Level;
+    auto JTMB = ExitOnErr(KaleidoscopeJIT::getTargetMachineBuilder(Options));
+    // Objects are meant to be linked into other programs, which may well be
+    // position independent.
+    JTMB.setRelocationModel(Reloc::PIC_);
+    JTMB.setCodeGenOptLevel(Level.getSpeedupLevel() == 0 ? CodeGenOpt::None
+            : Level.getSpeedupLevel() == 1 ? CodeGenOpt::Less
+            : Level.getSpeedupLevel() == 2 ? CodeGenOpt::Default
+            : CodeGenOpt::Aggressive);
+    auto TM = ExitOnErr(JTMB.createTargetMachine());
+    M.setTargetTriple(TM->getTargetTriple().str());
+    M.setDataLayout(TM->createDataLayout());
+
+    if (Stats)
+        Stats->countInstructions(M, /*Optimized=*/false);
+    {
+        CompileStats::PhaseTimer T(Stats, CompileStats::Optimize);
+        Optimizer(Level, TM.get(), Options.Interprocedural, Options.VecLib)
+            .run(M);
     }
-    if (CurTok != ')')
-        return LogError("expected ')'");
-    getNextToken();
-    return V;
-}
-
-// Parse identifier expressions.
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
-    getNextToken();
-
-    if (CurTok != '(') // Not a function call, defo a variable.
-        return std::make_unique<VariableExprAST>(IdName);
-
-    // It's a function call
-    getNextToken();
-    std::vector<std::unique_ptr<ExprAST>> Args;
-    if (CurTok != ')') {
-        while (true) {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
-            if (CurTok== ')')
-                break;
-            if (CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list");
-            getNextToken();
-        }
+    if (Stats)
+        Stats->countInstructions(M, /*Optimized=*/true);
+
+    auto OpenOutput = [](StringRef Filename, sys::fs::OpenFlags Flags) {
+        std::error_code EC;
+        auto OS = std::make_unique<raw_fd_ostream>(Filename, EC, Flags);
+        if (EC)
+            ExitOnErr(createStringError(EC, "could not open '%s'",
+                                        Filename.str().c_str()));
+        return OS;
+    };
+
+    if (!EmitLLVM.empty())
+        M.print(*OpenOutput(EmitLLVM, sys::fs::OF_Text), nullptr);
+    if (!EmitBC.empty())
+        WriteBitcodeToFile(M, *OpenOutput(EmitBC, sys::fs::OF_None));
+    if (!EmitObj.empty()) {
+        auto OS = OpenOutput(EmitObj, sys::fs::OF_None);
+        legacy::PassManager PM;
+        if (TM->addPassesToEmitFile(PM, *OS, nullptr, CGFT_ObjectFile))
+            ExitOnErr(createStringError(inconvertibleErrorCode(),
+                    "target can't emit object files"));
+        CompileStats::PhaseTimer T(Stats, CompileStats::CodeGen);
+        PM.run(M);
     }
-
-    getNextToken();
-
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
-// Parse primary expressions (identifiers, number literals and parenthesized
-// expressions).
-static std::unique_ptr<ExprAST> ParsePrimary() {
-    switch (CurTok) {
-        default:
-            return LogError("unknown token, expecting expression");
-        case tok_identifier:
-          return ParseIdentifierExpr();
-        case tok_number:
-          return ParseNumberExpr();
-        case '(':
-          return ParseParenExpr();
+// Write the --stats report, after everything has been compiled and run.
+static void PrintStatsReport(const KaleidoscopeSession &Session) {
+    if (StatsFile.empty()) {
+        Session.printStats(errs());
+        return;
     }
+    std::error_code EC;
+    raw_fd_ostream OS(StatsFile, EC, sys::fs::OF_Text);
+    if (EC)
+        ExitOnErr(createStringError(EC, "could not open '%s'",
+                                    StatsFile.c_str()));
+    Session.printStats(OS);
 }
 
-// Parsing binary expressions.
-static std::map<char, int> BinopPrecedence;
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+    ExitOnErr.setBanner(std::string(argv[0]) + ": ");
 
-// GetTokPrecedence - Get the precedence of the pending binary operator
-// token.
-static int GetTokPrecedence() {
-    if (!isascii(CurTok))
-        return -1;
-
-    // Is it a valid binary operation.
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0) return -1;
-    return TokPrec;
-}
-
-// Parse binary operation right hand side.
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-        std::unique_ptr<ExprAST> LHS) {
-    while (true) {
-        int TokPrec = GetTokPrecedence();
-
-        if (TokPrec < ExprPrec)
-            return LHS;
-        int BinOp = CurTok;
-        getNextToken();
-
-        auto RHS = ParsePrimary();
-        if (!RHS)
-            return nullptr;
-        int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
-        }
-
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS),
-                std::move(RHS));
-    }
-}
-
-// Parse expression implementation.
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary();
-    if (!LHS)
-        return nullptr;
-
-    return ParseBinOpRHS(0, std::move(LHS));
-}
-
-
-// Parse prototype functions.
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    if (CurTok != tok_identifier)
-        return LogErrorP("Expected function name in prototype");
-
-    std::string FnName = IdentifierStr;
-    getNextToken();
-
-    if (CurTok != '(')
-        return LogErrorP("Expected '(' in prototype");
-
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
-    if (CurTok != ')')
-        return LogErrorP("Expected ')' in prototype");
-
-    getNextToken();
-
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
-}
-
-// Parse function definitions.
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-    getNextToken();
-    auto Proto = ParsePrototype();
-    if (!Proto) return nullptr;
-
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    return nullptr;
-}
-
-// Parse extern expressions.
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-    getNextToken();
-    return ParsePrototype();
-}
-
-// Parse top level expression.
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        auto Proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    }
-    return nullptr;
-}
-
-// LLVM code generation.
-
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::map<std::string, Value *> NamedValues;
-
-// Log a value error.
-Value* LogErrorV(const char *Str) {
-    LogError(Str);
-    return nullptr;
-}
-
-// Code gen for number expressions.
-Value *NumberExprAST::codegen() {
-    return ConstantFP::get(*TheContext, APFloat(Val));
-}
-
-// Code gen for variable expressions.
-Value *VariableExprAST::codegen() {
-    // Check the named values map
-    Value *V = NamedValues[Name];
-    if (!V)
-        LogErrorV("Unknown variable name");
-    return V;
-}
-
-// Code gen for binary expressions.
-Value *BinaryExprAST::codegen() {
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
-    if (!L || !R)
-        return nullptr;
-
-    switch (Op) {
-        case '+':
-            return Builder->CreateFAdd(L, R, "addtmp");
-        case '-':
-            return Builder->CreateFSub(L, R, "subtmp");
-        case '*':
-            return Builder->CreateFMul(L, R, "multmp");
-        case '<':
-            L = Builder->CreateFCmpULT(L, R, "cmptmp");
-            return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext),
-                    "booltmp");
-        default:
-            return LogErrorV("invalid binary operator");
-    }
-}
-
-// Code gen for function calls.
-Value *CallExprAST::codegen() {
-    // Look up the name in the global module table.
-    Function *CalleeF = TheModule->getFunction(Callee);
-    if (!CalleeF)
-        return LogErrorV("Unknown function referenced");
-    if (CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect number of arguments passed");
-
-    std::vector<Value *> ArgsV;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())
-            return nullptr;
+    CompilerOptions Options;
+    switch (OptLevel) {
+    case '0': Options.JIT.Level = OptimizationLevel::O0; break;
+    case '1': Options.JIT.Level = OptimizationLevel::O1; break;
+    case '2': Options.JIT.Level = OptimizationLevel::O2; break;
+    case '3': Options.JIT.Level = OptimizationLevel::O3; break;
+    default:
+        fprintf(stderr, "Error: invalid optimization level -O%c\n",
+                (char)OptLevel);
+        return 1;
     }
-
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
-}
-
-// Code gen for function prototypes.
-Function *PrototypeAST::codegen() {
-    // Declare the function type.
-    std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-    FunctionType *FT =
-        FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
-    Function *F =
-        Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
-    unsigned Idx = 0;
-    for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
-    return F;
-}
-
-// Code gen for function bodies.
-Function *FunctionAST::codegen() {
-    // Check for existing declarations.
-    Function *TheFunction = TheModule->getFunction(Proto->getName());
-    // Sanity checks.
-    if (!TheFunction)
-        TheFunction = Proto->codegen();
-    if (!TheFunction)
-        return nullptr;
-    if (!TheFunction->empty())
-        return (Function*)LogErrorV("Function cannot be redefined.");
-
-    // Create a new IR block.
-    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
-
-    // Record function arguments.
-    NamedValues.clear();
-    for (auto &Arg: TheFunction->args())
-        NamedValues[std::string(Arg.getName())] = &Arg;
-    if (Value *RetVal = Body->codegen()) {
-        // Insert return.
-        Builder->CreateRet(RetVal);
-
-        // Validate the genereated code.
-        verifyFunction(*TheFunction);
-
-        // Optimize this code block.
-        TheFPM->run(*TheFunction);
-
-        return TheFunction;
+    Options.JIT.NumCompileThreads = CompileThreads;
+    Options.JIT.CacheDir = CacheDir;
+    Options.JIT.CPU = MCPU;
+    Options.JIT.VecLib = getVectorLibrary();
+    Options.JIT.PerfMap = PerfMap;
+    Options.Lazy = LazyCompile;
+    Options.AheadOfTime = isEmittingFiles();
+    Options.WholeFile = WholeFile;
+    Options.JIT.Interprocedural = WholeFile;
+    Options.Tiered = Tiered;
+    Options.TierUpThreshold = TierUpThreshold;
+    Options.ProfileGenerate = !ProfileGenerate.empty();
+    Options.ProfileUse = ProfileUse;
+
+    if (FastMath)
+        Options.FMF.setFast();
+    if (Reassoc)
+        Options.FMF.setAllowReassoc();
+    if (FPContract)
+        Options.FMF.setAllowContract();
+    Options.JIT.FuseFPOps = Options.FMF.allowContract();
+
+    std::unique_ptr<CompileStats> Stats;
+    if (AreStatisticsEnabled() || !StatsFile.empty()) {
+        // Statistics only count once enabled, before anything else runs.
+        EnableStatistics(/*DoPrintOnExit=*/false);
+        Stats = std::make_unique<CompileStats>();
+        Options.JIT.Stats = Stats.get();
     }
-    TheFunction->eraseFromParent();
-    return nullptr;
-}
-
-static void InitializeModule() {
-  // Open a new context and module.
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("my cool jit", *TheContext);
-
-  // Create a new builder for the module.
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
-}
-
-// Initialize a module and pass manager.
-void InitializeModuleAndPassManager(void) {
-    // Create a new LLVM context and module.
-    TheModule = std::make_unique<Module>("my cool jut", *TheContext);
-
-    // Create and attach a pass manager to our module.
-    TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
-
-    // Peephole optimizations, Peephole optimizations are performed on a small
-    // set of operations replacing them by faster implementations
-    // for example consider the following code :
-    // b = a + a
-    // This would be replaced by a left shift on A (equivalent to mul by two).
-    TheFPM->add(createInstructionCombiningPass());
-    // Reassociate expressions.
-    TheFPM->add(createReassociatePass());
-    // Eliminate Common SubExpressions, CSE eliminates repetitive expressions
-    // for example consider the following code :
-    // x1 = y * z + b1;
-    // x2 = y * z + b2;
-    // CSE will rewrite it as follows :
-    // t = y * z;
-    // x1 = t + b1;
-    // x2 = t + b2;
-    TheFPM->add(createGVNPass());
-    // CFG simplification will simplify the control flow graph by removing
-    // dead code or eliminating impossible branches (e.g if a constant is
-    // compared to another compile time value).
-    TheFPM->add(createCFGSimplificationPass());
-
-    TheFPM->doInitialization();
-}
 
-static void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:\n");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      // Initialize the pass manager.
-      InitializeModuleAndPassManager();
+    // Lex straight out of the (memory mapped) files if we were given any,
+    // otherwise read stdin as a REPL.
+    if (InputFilenames.empty())
+        InputFilenames.push_back("-");
+    std::vector<SourceFile> Files;
+    for (const std::string &Filename : InputFilenames) {
+        if (Filename == "-" && InputFilenames.size() == 1) {
+            Files.push_back({Filename, std::make_unique<StdinSourceBuffer>()});
+            continue;
+        }
+        auto SB = FileSourceBuffer::create(Filename);
+        if (!SB) {
+            fprintf(stderr, "Error: could not open '%s': %s\n",
+                    Filename.c_str(), SB.getError().message().c_str());
+            return 1;
+        }
+        Files.push_back({Filename, std::move(*SB)});
     }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
 
-static void HandleExtern() {
-  if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: \n");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-    }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
+    // Initialize the JIT, unless compiling ahead of time, and the first
+    // module.
+    auto Session = ExitOnErr(KaleidoscopeSession::Create(Options));
 
-static void HandleTopLevelExpression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read top-level expression: \n");
-      FnIR->print(errs());
-      fprintf(stderr, "\n");
-      InitializeModuleAndPassManager();
-
-      // Remove the anonymous expression.
-      FnIR->eraseFromParent();
+    // Run the main looop, or parse several files at once.
+    if (Files.size() == 1) {
+        bool Interactive = InputFilenames.front() == "-";
+        ExitOnErr(Session->run(std::move(Files.front().Source), Interactive));
+    } else {
+        ExitOnErr(Session->runFiles(std::move(Files), ParseThreads));
     }
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
-  }
-}
 
+    if (Options.ProfileGenerate)
+        ExitOnErr(Session->writeProfile(ProfileGenerate));
 
-/// Main loop consumes tokens and calls the respective handler for each
-/// token.
-static void MainLoop() {
-  while (true) {
-    fprintf(stderr, "ready> ");
-    switch (CurTok) {
-    case tok_eof:
-      return;
-    case ';': // ignore top-level semicolons.
-      getNextToken();
-      break;
-    case tok_def:
-      HandleDefinition();
-      break;
-    case tok_extern:
-      HandleExtern();
-      break;
-    default:
-      HandleTopLevelExpression();
-      break;
+    if (Options.AheadOfTime) {
+        EmitFiles(*Session, Options.JIT);
+    } else {
+        // On exit print all collected errors
+        Session->getModule().print(errs(), nullptr);
     }
-  }
-}
-
 
-int main(void) {
-    // Fill the binary precedence map
-     BinopPrecedence['<'] = 10;
-     BinopPrecedence['+'] = 20;
-     BinopPrecedence['-'] = 20;
-     BinopPrecedence['*'] = 40;
-    // Start the interpreter.
-     fprintf(stderr, "ready> ");
-     getNextToken();
-     // Initialize JIT module
-     InitializeModule();
-
-     InitializeModuleAndPassManager();
-    // Run the main looop
-     MainLoop();
-    // On exit print all collected errors
-    TheModule->print(errs(), nullptr);
-
-     return 0;
+    if (Stats)
+        PrintStatsReport(*Session);
+    return 0;
 }
@@ -0,0 +1,82 @@
+// kaleidoscope-kernel-test - Batch kernels, which only code embedding the
+// compiler can call, run against what they were compiled from.
+//
+// Each check compiles a program, runs a kernel over a few inputs and compares
+// what it gives with the expected results, printing the ones that differ.
+// The exit status is the number of failed checks.
+
+// C++ STL imports
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// LLVM imports
+#include "llvm/Support/Error.h"
+
+#include "Kaleidoscope.h"
+
+using namespace llvm;
+
+namespace {
+
+ExitOnError ExitOnErr;
+
+std::unique_ptr<KaleidoscopeSession> createSession() {
+    CompilerOptions Options;
+    Options.PrintIR = false;
+    return ExitOnErr(KaleidoscopeSession::Create(Options));
+}
+
+// Run the one-argument kernel Name over In, true if it gives Expected.
+bool checkKernel(KaleidoscopeSession &S, const char *Name,
+                 const std::vector<double> &In,
+                 const std::vector<double> &Expected) {
+    auto *K = ExitOnErr(S.lookup<void(const double *, double *, size_t)>(Name));
+    std::vector<double> Out(In.size());
+    K(In.data(), Out.data(), In.size());
+    if (Out == Expected)
+        return true;
+    fprintf(stderr, "%s:", Name);
+    for (size_t I = 0; I != In.size(); ++I)
+        fprintf(stderr, " %s(%g) = %g, expected %g;", Name, In[I], Out[I],
+                Expected[I]);
+    fputc('\n', stderr);
+    return false;
+}
+
+// The kernel of a memoized function that calls one that is redefined: the
+// results it memoized with the old definition go with it.
+bool testMemoDependent() {
+    auto S = createSession();
+    ExitOnErr(S->compile("def f(x) x + 1;\n"
+                         "memo def h(x) f(x) * 2;\n"
+                         "vectorize h;\n"));
+    bool OK = checkKernel(*S, "h_batch", {1, 2, 3}, {4, 6, 8});
+    ExitOnErr(S->compile("def f(x) x + 2;\n"));
+    return checkKernel(*S, "h_batch", {1, 2, 3}, {6, 8, 10}) && OK;
+}
+
+// The kernel of the redefined function itself, and of a plain dependent.
+bool testRedefined() {
+    auto S = createSession();
+    ExitOnErr(S->compile("def f(x) x + 1;\n"
+                         "def g(x) f(x) * 2;\n"
+                         "vectorize f;\n"
+                         "vectorize g;\n"));
+    bool OK = checkKernel(*S, "f_batch", {1, 2}, {2, 3});
+    OK = checkKernel(*S, "g_batch", {1, 2}, {4, 6}) && OK;
+    ExitOnErr(S->compile("def f(x) x * 3;\n"));
+    OK = checkKernel(*S, "f_batch", {1, 2}, {3, 6}) && OK;
+    return checkKernel(*S, "g_batch", {1, 2}, {6, 12}) && OK;
+}
+
+} // end anonymous namespace
+
+int main() {
+    int NumFailed = 0;
+    for (bool (*Test)() : {testMemoDependent, testRedefined})
+        NumFailed += !Test();
+    return NumFailed;
+}
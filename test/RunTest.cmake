@@ -0,0 +1,77 @@
+# Run the kaleidoscope driver over INPUT with ARGS, REPEAT times (default
+# once), and check that it succeeds every time and that what it reports
+# (results, errors and warnings, the IR it prints aside) matches EXPECTED.
+# INPUT may list several files, separated by spaces, to compile as one
+# program. MATCH, a regular expression, picks more of the lines the driver
+# writes to compare, e.g. those of ":mem". With OUTPUT, a file the driver
+# writes, what it holds (comments aside) is expected after what the driver
+# reported. With PERF_MAP, so are the names in the perf map of --perf-map,
+# sorted as "perf map: <name>" lines.
+#
+#   cmake -DKALEIDOSCOPE=<driver> -DINPUT="<file.kal>..." -DEXPECTED=<file>
+#         [-DARGS=<flags>] [-DREPEAT=<n>] [-DMATCH=<regex>] [-DOUTPUT=<file>]
+#         [-DPERF_MAP=ON] -P RunTest.cmake
+
+if(NOT REPEAT)
+  set(REPEAT 1)
+endif()
+set(Match "Evaluated to|Error|Warning|JIT session error")
+if(MATCH)
+  string(APPEND Match "|${MATCH}")
+endif()
+separate_arguments(ARGS UNIX_COMMAND "${ARGS}")
+separate_arguments(INPUT UNIX_COMMAND "${INPUT}")
+file(READ ${EXPECTED} Expected)
+
+foreach(Run RANGE 1 ${REPEAT})
+  if(OUTPUT)
+    file(REMOVE ${OUTPUT})
+  endif()
+  string(TIMESTAMP Start "%s")
+  execute_process(COMMAND ${KALEIDOSCOPE} ${ARGS} ${INPUT}
+                  RESULT_VARIABLE Result
+                  OUTPUT_VARIABLE Output
+                  ERROR_VARIABLE Output)
+  if(NOT Result EQUAL 0)
+    message(FATAL_ERROR "run ${Run}: exited with ${Result}:\n${Output}")
+  endif()
+  string(REGEX MATCHALL "(${Match})[^\n]*\n" Reported "${Output}")
+  string(REPLACE ";" "" Reported "${Reported}")
+  if(OUTPUT)
+    file(STRINGS ${OUTPUT} Lines REGEX "^[^#]")
+    foreach(Line ${Lines})
+      string(APPEND Reported "${Line}\n")
+    endforeach()
+  endif()
+  if(PERF_MAP)
+    # The map is named after the driver's pid: the one written since it
+    # started.
+    file(GLOB Maps /tmp/perf-*.map)
+    set(Map "")
+    foreach(File ${Maps})
+      file(TIMESTAMP ${File} Written "%s")
+      if(NOT Written LESS Start)
+        list(APPEND Map ${File})
+      endif()
+    endforeach()
+    list(LENGTH Map NumMaps)
+    if(NOT NumMaps EQUAL 1)
+      message(FATAL_ERROR "run ${Run}: expected one new perf map, found "
+                          "${NumMaps}: ${Map}")
+    endif()
+    file(STRINGS ${Map} Lines)
+    file(REMOVE ${Map})
+    set(Names "")
+    foreach(Line ${Lines})
+      string(REGEX REPLACE "^[0-9a-f]+ [0-9a-f]+ " "" Name "${Line}")
+      list(APPEND Names "${Name}")
+    endforeach()
+    list(SORT Names)
+    foreach(Name ${Names})
+      string(APPEND Reported "perf map: ${Name}\n")
+    endforeach()
+  endif()
+  if(NOT Reported STREQUAL Expected)
+    message(FATAL_ERROR "run ${Run}: expected\n${Expected}but got\n${Reported}")
+  endif()
+endforeach()